@@ -3,6 +3,30 @@
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
 
+// Interlocked read-modify-write operations are full barriers on x86 and x64,
+// which is at least as strong as any order, so their order arguments are
+// accepted but need no extra work. Loads and stores are plain moves; x86 never
+// reorders loads with loads or stores with stores, so acquire and release only
+// have to stop the compiler. Only a seq_cst store needs a locked instruction,
+// to keep it from passing a later load.
+#if defined(_M_IX86) || defined(_M_X64)
+#define atomic_ordering_barrier() _ReadWriteBarrier()
+#else
+#define atomic_ordering_barrier() MemoryBarrier()
+#endif
+
+void atomic_fence(atomic_order_t order)
+{
+	if (order == k_atomic_seq_cst)
+	{
+		MemoryBarrier();
+	}
+	else if (order != k_atomic_relaxed)
+	{
+		atomic_ordering_barrier();
+	}
+}
+
 int atomic_increment(int* address)
 {
 	return InterlockedIncrement(address) - 1;
@@ -13,17 +37,203 @@ int atomic_decrement(int* address)
 	return InterlockedDecrement(address) + 1;
 }
 
+int atomic_fetch_add(int* address, int value)
+{
+	return InterlockedExchangeAdd(address, value);
+}
+
+int atomic_fetch_add_explicit(int* address, int value, atomic_order_t order)
+{
+	return InterlockedExchangeAdd(address, value);
+}
+
 int atomic_compare_and_exchange(int* dest, int compare, int exchange)
 {
 	return InterlockedCompareExchange(dest, exchange, compare);
 }
 
+int atomic_compare_and_exchange_explicit(int* dest, int compare, int exchange, atomic_order_t order)
+{
+	return InterlockedCompareExchange(dest, exchange, compare);
+}
+
+int atomic_exchange(int* address, int value)
+{
+	return InterlockedExchange(address, value);
+}
+
+int atomic_exchange_explicit(int* address, int value, atomic_order_t order)
+{
+	return InterlockedExchange(address, value);
+}
+
 int atomic_load(int* address)
 {
-	return *(volatile int*)address;
+	return atomic_load_explicit(address, k_atomic_acquire);
+}
+
+int atomic_load_explicit(int* address, atomic_order_t order)
+{
+	int value = *(volatile int*)address;
+	if (order != k_atomic_relaxed)
+	{
+		atomic_ordering_barrier();
+	}
+	return value;
 }
 
 void atomic_store(int* address, int value)
 {
+	atomic_store_explicit(address, value, k_atomic_release);
+}
+
+void atomic_store_explicit(int* address, int value, atomic_order_t order)
+{
+	if (order == k_atomic_seq_cst)
+	{
+		InterlockedExchange(address, value);
+		return;
+	}
+	if (order != k_atomic_relaxed)
+	{
+		atomic_ordering_barrier();
+	}
 	*(volatile int*)address = value;
 }
+
+int64_t atomic_increment64(int64_t* address)
+{
+	return InterlockedIncrement64(address) - 1;
+}
+
+int64_t atomic_decrement64(int64_t* address)
+{
+	return InterlockedDecrement64(address) + 1;
+}
+
+int64_t atomic_fetch_add64(int64_t* address, int64_t value)
+{
+	return InterlockedExchangeAdd64(address, value);
+}
+
+int64_t atomic_fetch_add64_explicit(int64_t* address, int64_t value, atomic_order_t order)
+{
+	return InterlockedExchangeAdd64(address, value);
+}
+
+int64_t atomic_compare_and_exchange64(int64_t* dest, int64_t compare, int64_t exchange)
+{
+	return InterlockedCompareExchange64(dest, exchange, compare);
+}
+
+int64_t atomic_compare_and_exchange64_explicit(int64_t* dest, int64_t compare, int64_t exchange, atomic_order_t order)
+{
+	return InterlockedCompareExchange64(dest, exchange, compare);
+}
+
+int64_t atomic_exchange64(int64_t* address, int64_t value)
+{
+	return InterlockedExchange64(address, value);
+}
+
+int64_t atomic_exchange64_explicit(int64_t* address, int64_t value, atomic_order_t order)
+{
+	return InterlockedExchange64(address, value);
+}
+
+int64_t atomic_load64(int64_t* address)
+{
+	return atomic_load64_explicit(address, k_atomic_acquire);
+}
+
+int64_t atomic_load64_explicit(int64_t* address, atomic_order_t order)
+{
+#if defined(_WIN64)
+	int64_t value = *(volatile int64_t*)address;
+	if (order != k_atomic_relaxed)
+	{
+		atomic_ordering_barrier();
+	}
+	return value;
+#else
+	// 32-bit targets can't read 64 bits in one instruction.
+	return InterlockedCompareExchange64(address, 0, 0);
+#endif
+}
+
+void atomic_store64(int64_t* address, int64_t value)
+{
+	atomic_store64_explicit(address, value, k_atomic_release);
+}
+
+void atomic_store64_explicit(int64_t* address, int64_t value, atomic_order_t order)
+{
+#if defined(_WIN64)
+	if (order == k_atomic_seq_cst)
+	{
+		InterlockedExchange64(address, value);
+		return;
+	}
+	if (order != k_atomic_relaxed)
+	{
+		atomic_ordering_barrier();
+	}
+	*(volatile int64_t*)address = value;
+#else
+	InterlockedExchange64(address, value);
+#endif
+}
+
+void* atomic_compare_and_exchange_pointer(void** dest, void* compare, void* exchange)
+{
+	return InterlockedCompareExchangePointer(dest, exchange, compare);
+}
+
+void* atomic_compare_and_exchange_pointer_explicit(void** dest, void* compare, void* exchange, atomic_order_t order)
+{
+	return InterlockedCompareExchangePointer(dest, exchange, compare);
+}
+
+void* atomic_exchange_pointer(void** dest, void* exchange)
+{
+	return InterlockedExchangePointer(dest, exchange);
+}
+
+void* atomic_exchange_pointer_explicit(void** dest, void* exchange, atomic_order_t order)
+{
+	return InterlockedExchangePointer(dest, exchange);
+}
+
+void* atomic_load_pointer(void** address)
+{
+	return atomic_load_pointer_explicit(address, k_atomic_acquire);
+}
+
+void* atomic_load_pointer_explicit(void** address, atomic_order_t order)
+{
+	void* value = *(void* volatile*)address;
+	if (order != k_atomic_relaxed)
+	{
+		atomic_ordering_barrier();
+	}
+	return value;
+}
+
+void atomic_store_pointer(void** address, void* value)
+{
+	atomic_store_pointer_explicit(address, value, k_atomic_release);
+}
+
+void atomic_store_pointer_explicit(void** address, void* value, atomic_order_t order)
+{
+	if (order == k_atomic_seq_cst)
+	{
+		InterlockedExchangePointer(address, value);
+		return;
+	}
+	if (order != k_atomic_relaxed)
+	{
+		atomic_ordering_barrier();
+	}
+	*(void* volatile*)address = value;
+}
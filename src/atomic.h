@@ -1,5 +1,32 @@
 #pragma once
 
+#include <stdint.h>
+
+// Atomic operations on 32-bit integers, 64-bit integers and pointers.
+//
+// Every operation has an _explicit variant taking a memory order, with the
+// same meaning as the C11 orders. The plain variants use the order noted on
+// each function.
+
+// Memory ordering constraint of an atomic operation.
+typedef enum atomic_order_t
+{
+	// Atomic, but imposes no ordering on other memory accesses.
+	k_atomic_relaxed,
+	// Later reads and writes can't move before this operation.
+	// Pairs with a release on the same address to see the writes preceding it.
+	k_atomic_acquire,
+	// Earlier reads and writes can't move after this operation.
+	k_atomic_release,
+	// Both acquire and release. Only meaningful for read-modify-write operations.
+	k_atomic_acq_rel,
+	// Acquire and release, and all seq_cst operations appear in a single total order.
+	k_atomic_seq_cst,
+} atomic_order_t;
+
+// Issue a memory fence with the given order, without touching memory.
+void atomic_fence(atomic_order_t order);
+
 // Atomic operations on 32-bit integers.
 
 // Increment a number atomically.
@@ -14,16 +41,81 @@ int atomic_increment(int* address);
 //   int old_value = *address; (*address)--; return old_value;
 int atomic_decrement(int* address);
 
-// Compare two numbers atomically and assign if equal.
+// Add to a number atomically. Sequentially consistent.
+// Returns the old value of the number.
+// Performs the following operation atomically:
+//   int old_value = *address; *address += value; return old_value;
+int atomic_fetch_add(int* address, int value);
+int atomic_fetch_add_explicit(int* address, int value, atomic_order_t order);
+
+// Compare two numbers atomically and assign if equal. Sequentially consistent.
 // Returns the old value of the number.
 // Performs the following operation atomically:
 //   int old_value = *address; if (*address == compare) *address = exchange; return old_value;
 int atomic_compare_and_exchange(int* dest, int compare, int exchange);
+int atomic_compare_and_exchange_explicit(int* dest, int compare, int exchange, atomic_order_t order);
+
+// Assign a number atomically. Sequentially consistent.
+// Returns the old value of the number.
+int atomic_exchange(int* address, int value);
+int atomic_exchange_explicit(int* address, int value, atomic_order_t order);
 
-// Reads an integer from an address.
-// All writes that occurred before the last atomic_store to this address are flushed.
+// Reads an integer from an address. Acquire.
+// All writes that occurred before the last atomic_store to this address are visible.
 int atomic_load(int* address);
+int atomic_load_explicit(int* address, atomic_order_t order);
 
-// Writes an integer.
+// Writes an integer. Release.
 // Paired with an atomic_load, can guarantee ordering and visibility.
+// A release store may still move after a later load of another address;
+// use k_atomic_seq_cst when that matters.
 void atomic_store(int* address, int value);
+void atomic_store_explicit(int* address, int value, atomic_order_t order);
+
+// Atomic operations on 64-bit integers.
+// Same semantics as the 32-bit operations of the same name.
+
+// Increment a 64-bit number atomically. Returns the old value.
+int64_t atomic_increment64(int64_t* address);
+
+// Decrement a 64-bit number atomically. Returns the old value.
+int64_t atomic_decrement64(int64_t* address);
+
+// Add to a 64-bit number atomically. Returns the old value.
+int64_t atomic_fetch_add64(int64_t* address, int64_t value);
+int64_t atomic_fetch_add64_explicit(int64_t* address, int64_t value, atomic_order_t order);
+
+// Compare two 64-bit numbers atomically and assign if equal. Returns the old value.
+int64_t atomic_compare_and_exchange64(int64_t* dest, int64_t compare, int64_t exchange);
+int64_t atomic_compare_and_exchange64_explicit(int64_t* dest, int64_t compare, int64_t exchange, atomic_order_t order);
+
+// Assign a 64-bit number atomically. Returns the old value.
+int64_t atomic_exchange64(int64_t* address, int64_t value);
+int64_t atomic_exchange64_explicit(int64_t* address, int64_t value, atomic_order_t order);
+
+// Reads a 64-bit integer from an address without tearing, even on 32-bit targets.
+int64_t atomic_load64(int64_t* address);
+int64_t atomic_load64_explicit(int64_t* address, atomic_order_t order);
+
+// Writes a 64-bit integer without tearing, even on 32-bit targets.
+void atomic_store64(int64_t* address, int64_t value);
+void atomic_store64_explicit(int64_t* address, int64_t value, atomic_order_t order);
+
+// Atomic operations on pointers.
+// Same semantics as the 32-bit operations of the same name.
+
+// Compare two pointers atomically and assign if equal. Returns the old value.
+void* atomic_compare_and_exchange_pointer(void** dest, void* compare, void* exchange);
+void* atomic_compare_and_exchange_pointer_explicit(void** dest, void* compare, void* exchange, atomic_order_t order);
+
+// Assign a pointer atomically. Returns the old value.
+void* atomic_exchange_pointer(void** dest, void* exchange);
+void* atomic_exchange_pointer_explicit(void** dest, void* exchange, atomic_order_t order);
+
+// Reads a pointer from an address.
+void* atomic_load_pointer(void** address);
+void* atomic_load_pointer_explicit(void** address, atomic_order_t order);
+
+// Writes a pointer.
+void atomic_store_pointer(void** address, void* value);
+void atomic_store_pointer_explicit(void** address, void* value, atomic_order_t order);
@@ -0,0 +1,685 @@
+#include "bench.h"
+
+#include "atomic.h"
+#include "debug.h"
+#include "event.h"
+#include "fs.h"
+#include "heap.h"
+#include "job.h"
+#include "mutex.h"
+#include "queue.h"
+#include "queue_spsc.h"
+#include "rwlock.h"
+#include "semaphore.h"
+#include "seqlock.h"
+#include "thread.h"
+#include "timer.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+enum
+{
+	k_bench_max_threads = 8,
+	k_bench_max_results = 64,
+
+	// Increments per thread in counter tests.
+	k_bench_counter_iterations = 100000,
+	// In read-mostly tests, one lookup in this many is an update.
+	k_bench_write_interval = 256,
+	// Items pushed per producer in queue tests.
+	k_bench_handoff_items = 50000,
+	k_bench_queue_capacity = 256,
+	// Round trips in semaphore and event tests.
+	k_bench_ping_pong_rounds = 10000,
+	// Empty jobs submitted in job system tests.
+	k_bench_job_count = 100000,
+
+	k_bench_json_capacity = 32 * 1024,
+};
+
+// One line of results.
+// Latency is only measured by handoff tests.
+typedef struct bench_result_t
+{
+	const char* name;
+	int producers;
+	int consumers;
+	uint64_t operations;
+	uint64_t ticks;
+	bool has_latency;
+	uint64_t p50_ns;
+	uint64_t p99_ns;
+} bench_result_t;
+
+typedef struct bench_t
+{
+	heap_t* heap;
+	job_system_t* jobs;
+	bench_result_t results[k_bench_max_results];
+	int result_count;
+} bench_t;
+
+typedef struct thread_data_t
+{
+	int* counter;
+	mutex_t* mutex;
+	rwlock_t* rwlock;
+	seqlock_t* seqlock;
+	event_t* start;
+
+	// Small shared table for the read-mostly tests.
+	// Writers keep every entry equal, so readers can detect torn reads.
+	int table[4];
+} thread_data_t;
+
+// Shared state of a queue handoff test.
+// Producers stamp each item's push time; consumers record how long it took to arrive.
+typedef struct handoff_t
+{
+	void* queue;
+	void (*push)(void* queue, void* item);
+	void* (*pop)(void* queue);
+
+	event_t* start;
+	int next_producer;
+	int next_consumer;
+
+	uint64_t* stamps;
+	uint64_t* latencies[k_bench_max_threads];
+	int latency_counts[k_bench_max_threads];
+} handoff_t;
+
+// Shared state of a semaphore or event round trip test.
+typedef struct ping_pong_t
+{
+	semaphore_t* ping_semaphore;
+	semaphore_t* pong_semaphore;
+	event_t** ping_events;
+	event_t** pong_events;
+
+	uint64_t stamp;
+	uint64_t* latencies;
+} ping_pong_t;
+
+static int no_synchronization_func(void* user)
+{
+	thread_data_t* thread_data = user;
+	event_wait(thread_data->start);
+
+	for (int i = 0; i < k_bench_counter_iterations; ++i)
+	{
+		*thread_data->counter = *thread_data->counter + 1;
+	}
+
+	return 0;
+}
+
+static int atomic_load_store_func(void* user)
+{
+	thread_data_t* thread_data = user;
+	event_wait(thread_data->start);
+
+	for (int i = 0; i < k_bench_counter_iterations; ++i)
+	{
+		atomic_store(thread_data->counter, atomic_load(thread_data->counter) + 1);
+	}
+
+	return 0;
+}
+
+static int atomic_increment_func(void* user)
+{
+	thread_data_t* thread_data = user;
+	event_wait(thread_data->start);
+
+	for (int i = 0; i < k_bench_counter_iterations; ++i)
+	{
+		atomic_increment(thread_data->counter);
+	}
+
+	return 0;
+}
+
+static int mutex_func(void* user)
+{
+	thread_data_t* thread_data = user;
+	event_wait(thread_data->start);
+
+	for (int i = 0; i < k_bench_counter_iterations; ++i)
+	{
+		mutex_lock(thread_data->mutex);
+		*thread_data->counter = *thread_data->counter + 1;
+		mutex_unlock(thread_data->mutex);
+	}
+
+	return 0;
+}
+
+static void bench_table_write(thread_data_t* thread_data, int value)
+{
+	for (int i = 0; i < _countof(thread_data->table); ++i)
+	{
+		thread_data->table[i] = value;
+	}
+}
+
+static int bench_table_read(thread_data_t* thread_data, int* torn)
+{
+	int sum = 0;
+	for (int i = 0; i < _countof(thread_data->table); ++i)
+	{
+		sum += ((volatile int*)thread_data->table)[i];
+	}
+	*torn = sum != thread_data->table[0] * _countof(thread_data->table);
+	return sum;
+}
+
+// Read-mostly lookups of a small table, guarded by a mutex.
+static int mutex_table_func(void* user)
+{
+	thread_data_t* thread_data = user;
+	event_wait(thread_data->start);
+
+	int torn_reads = 0;
+	for (int i = 0; i < k_bench_counter_iterations; ++i)
+	{
+		mutex_lock(thread_data->mutex);
+		if (i % k_bench_write_interval == 0)
+		{
+			bench_table_write(thread_data, i);
+		}
+		int torn;
+		bench_table_read(thread_data, &torn);
+		torn_reads += torn;
+		mutex_unlock(thread_data->mutex);
+	}
+
+	return torn_reads;
+}
+
+// Same as mutex_table_func with a reader-writer lock.
+static int rwlock_table_func(void* user)
+{
+	thread_data_t* thread_data = user;
+	event_wait(thread_data->start);
+
+	int torn_reads = 0;
+	for (int i = 0; i < k_bench_counter_iterations; ++i)
+	{
+		if (i % k_bench_write_interval == 0)
+		{
+			rwlock_lock_write(thread_data->rwlock);
+			bench_table_write(thread_data, i);
+			rwlock_unlock_write(thread_data->rwlock);
+		}
+		int torn;
+		rwlock_lock_read(thread_data->rwlock);
+		bench_table_read(thread_data, &torn);
+		rwlock_unlock_read(thread_data->rwlock);
+		torn_reads += torn;
+	}
+
+	return torn_reads;
+}
+
+// Same as mutex_table_func with a sequence lock.
+static int seqlock_table_func(void* user)
+{
+	thread_data_t* thread_data = user;
+	event_wait(thread_data->start);
+
+	int torn_reads = 0;
+	for (int i = 0; i < k_bench_counter_iterations; ++i)
+	{
+		if (i % k_bench_write_interval == 0)
+		{
+			seqlock_write_begin(thread_data->seqlock);
+			bench_table_write(thread_data, i);
+			seqlock_write_end(thread_data->seqlock);
+		}
+		int torn;
+		int sequence;
+		do
+		{
+			sequence = seqlock_read_begin(thread_data->seqlock);
+			bench_table_read(thread_data, &torn);
+		} while (seqlock_read_retry(thread_data->seqlock, sequence));
+		torn_reads += torn;
+	}
+
+	return torn_reads;
+}
+
+static bench_result_t* bench_add_result(bench_t* bench, const char* name, int producers, int consumers, uint64_t operations, uint64_t ticks)
+{
+	if (bench->result_count == k_bench_max_results)
+	{
+		debug_print(k_print_warning, "Too many benchmark results, dropping %s.\n", name);
+		return NULL;
+	}
+
+	bench_result_t* result = &bench->results[bench->result_count++];
+	result->name = name;
+	result->producers = producers;
+	result->consumers = consumers;
+	result->operations = operations;
+	result->ticks = ticks;
+	result->has_latency = false;
+	result->p50_ns = 0;
+	result->p99_ns = 0;
+	return result;
+}
+
+static int bench_compare_u64(const void* a, const void* b)
+{
+	uint64_t x = *(const uint64_t*)a;
+	uint64_t y = *(const uint64_t*)b;
+	return x < y ? -1 : x > y ? 1 : 0;
+}
+
+// Sort latency samples in ticks and store their percentiles in nanoseconds.
+static void bench_set_latency(bench_result_t* result, uint64_t* latencies, int count)
+{
+	if (!result || !count)
+	{
+		return;
+	}
+
+	qsort(latencies, count, sizeof(uint64_t), bench_compare_u64);
+
+	double ns_per_tick = 1000000000.0 / (double)timer_get_ticks_per_second();
+	result->has_latency = true;
+	result->p50_ns = (uint64_t)((double)latencies[count / 2] * ns_per_tick);
+	result->p99_ns = (uint64_t)((double)latencies[(int)((int64_t)count * 99 / 100)] * ns_per_tick);
+}
+
+// Increment a shared counter, or look up a shared table, from several threads at once.
+static void run_counter_test(bench_t* bench, int (*thread_func)(void*), const char* name, int thread_count)
+{
+	int counter = 0;
+	thread_data_t thread_data =
+	{
+		.counter = &counter,
+		.mutex = mutex_create(),
+		.rwlock = rwlock_create(bench->heap),
+		.seqlock = seqlock_create(bench->heap),
+		.start = event_create(bench->heap),
+	};
+
+	// Create threads.
+	thread_t* threads[k_bench_max_threads];
+	for (int i = 0; i < thread_count; ++i)
+	{
+		threads[i] = thread_create(thread_func, &thread_data);
+	}
+
+	// Go!
+	uint64_t start_ticks = timer_get_ticks();
+	event_signal(thread_data.start);
+
+	// Wait for threads to be done.
+	// Table tests return how many torn reads they saw.
+	int torn_reads = 0;
+	for (int i = 0; i < thread_count; ++i)
+	{
+		torn_reads += thread_destroy(threads[i]);
+	}
+	uint64_t ticks = timer_get_ticks() - start_ticks;
+
+	mutex_destroy(thread_data.mutex);
+	rwlock_destroy(thread_data.rwlock);
+	seqlock_destroy(thread_data.seqlock);
+	event_destroy(thread_data.start);
+
+	// Unsynchronized tests lose increments; the final count shows how many.
+	debug_print(k_print_info, "%s threads=%d counter=%d/%d torn_reads=%d\n",
+		name, thread_count, counter, thread_count * k_bench_counter_iterations, torn_reads);
+	bench_add_result(bench, name, thread_count, 0, (uint64_t)thread_count * k_bench_counter_iterations, ticks);
+}
+
+static void queue_push_wrapper(void* queue, void* item)
+{
+	queue_push(queue, item);
+}
+
+static void* queue_pop_wrapper(void* queue)
+{
+	return queue_pop(queue);
+}
+
+static void queue_spsc_push_wrapper(void* queue, void* item)
+{
+	queue_spsc_push(queue, item);
+}
+
+static void* queue_spsc_pop_wrapper(void* queue)
+{
+	return queue_spsc_pop(queue);
+}
+
+static int handoff_producer_func(void* user)
+{
+	handoff_t* handoff = user;
+	int first_item = atomic_increment(&handoff->next_producer) * k_bench_handoff_items;
+	event_wait(handoff->start);
+
+	// Items are 1-based indices into the stamp array, so NULL can stop consumers.
+	for (int i = first_item; i < first_item + k_bench_handoff_items; ++i)
+	{
+		handoff->stamps[i] = timer_get_ticks();
+		handoff->push(handoff->queue, (void*)(uintptr_t)(i + 1));
+	}
+
+	return 0;
+}
+
+static int handoff_consumer_func(void* user)
+{
+	handoff_t* handoff = user;
+	int consumer = atomic_increment(&handoff->next_consumer);
+	uint64_t* latencies = handoff->latencies[consumer];
+	int count = 0;
+	event_wait(handoff->start);
+
+	while (true)
+	{
+		void* item = handoff->pop(handoff->queue);
+		if (!item)
+		{
+			break;
+		}
+		latencies[count++] = timer_get_ticks() - handoff->stamps[(uintptr_t)item - 1];
+	}
+
+	handoff->latency_counts[consumer] = count;
+	return 0;
+}
+
+// Pass items from producers to consumers through a queue.
+static void run_handoff_test(bench_t* bench, const char* name, void* queue,
+	void (*push)(void*, void*), void* (*pop)(void*), int producer_count, int consumer_count)
+{
+	int item_count = producer_count * k_bench_handoff_items;
+
+	handoff_t handoff =
+	{
+		.queue = queue,
+		.push = push,
+		.pop = pop,
+		.start = event_create(bench->heap),
+		.stamps = heap_alloc(bench->heap, sizeof(uint64_t) * item_count, 8),
+	};
+	for (int i = 0; i < consumer_count; ++i)
+	{
+		// Any consumer may end up with every item.
+		handoff.latencies[i] = heap_alloc(bench->heap, sizeof(uint64_t) * item_count, 8);
+	}
+
+	thread_t* producers[k_bench_max_threads];
+	thread_t* consumers[k_bench_max_threads];
+	for (int i = 0; i < consumer_count; ++i)
+	{
+		consumers[i] = thread_create(handoff_consumer_func, &handoff);
+	}
+	for (int i = 0; i < producer_count; ++i)
+	{
+		producers[i] = thread_create(handoff_producer_func, &handoff);
+	}
+
+	uint64_t start_ticks = timer_get_ticks();
+	event_signal(handoff.start);
+
+	for (int i = 0; i < producer_count; ++i)
+	{
+		thread_destroy(producers[i]);
+	}
+	for (int i = 0; i < consumer_count; ++i)
+	{
+		push(queue, NULL);
+	}
+	for (int i = 0; i < consumer_count; ++i)
+	{
+		thread_destroy(consumers[i]);
+	}
+	uint64_t ticks = timer_get_ticks() - start_ticks;
+
+	// Gather every consumer's samples into the first array.
+	int latency_count = handoff.latency_counts[0];
+	for (int i = 1; i < consumer_count; ++i)
+	{
+		memcpy(handoff.latencies[0] + latency_count, handoff.latencies[i], sizeof(uint64_t) * handoff.latency_counts[i]);
+		latency_count += handoff.latency_counts[i];
+	}
+
+	bench_result_t* result = bench_add_result(bench, name, producer_count, consumer_count, item_count, ticks);
+	bench_set_latency(result, handoff.latencies[0], latency_count);
+
+	for (int i = 0; i < consumer_count; ++i)
+	{
+		heap_free(bench->heap, handoff.latencies[i]);
+	}
+	heap_free(bench->heap, handoff.stamps);
+	event_destroy(handoff.start);
+}
+
+static int semaphore_pong_func(void* user)
+{
+	ping_pong_t* ping_pong = user;
+	for (int i = 0; i < k_bench_ping_pong_rounds; ++i)
+	{
+		semaphore_acquire(ping_pong->ping_semaphore);
+		ping_pong->latencies[i] = timer_get_ticks() - ping_pong->stamp;
+		semaphore_release(ping_pong->pong_semaphore);
+	}
+	return 0;
+}
+
+static int event_pong_func(void* user)
+{
+	ping_pong_t* ping_pong = user;
+	for (int i = 0; i < k_bench_ping_pong_rounds; ++i)
+	{
+		event_wait(ping_pong->ping_events[i]);
+		ping_pong->latencies[i] = timer_get_ticks() - ping_pong->stamp;
+		event_signal(ping_pong->pong_events[i]);
+	}
+	return 0;
+}
+
+// Wake another thread and wait for it to wake us back, using a pair of semaphores.
+static void run_semaphore_test(bench_t* bench)
+{
+	ping_pong_t ping_pong =
+	{
+		.ping_semaphore = semaphore_create(bench->heap, 0, 1),
+		.pong_semaphore = semaphore_create(bench->heap, 0, 1),
+		.latencies = heap_alloc(bench->heap, sizeof(uint64_t) * k_bench_ping_pong_rounds, 8),
+	};
+
+	thread_t* thread = thread_create(semaphore_pong_func, &ping_pong);
+
+	uint64_t start_ticks = timer_get_ticks();
+	for (int i = 0; i < k_bench_ping_pong_rounds; ++i)
+	{
+		ping_pong.stamp = timer_get_ticks();
+		semaphore_release(ping_pong.ping_semaphore);
+		semaphore_acquire(ping_pong.pong_semaphore);
+	}
+	uint64_t ticks = timer_get_ticks() - start_ticks;
+	thread_destroy(thread);
+
+	bench_result_t* result = bench_add_result(bench, "semaphore", 1, 1, k_bench_ping_pong_rounds, ticks);
+	bench_set_latency(result, ping_pong.latencies, k_bench_ping_pong_rounds);
+
+	heap_free(bench->heap, ping_pong.latencies);
+	semaphore_destroy(ping_pong.ping_semaphore);
+	semaphore_destroy(ping_pong.pong_semaphore);
+}
+
+// Same as run_semaphore_test with events.
+// Events stay raised once signaled, so every round uses a fresh pair.
+static void run_event_test(bench_t* bench)
+{
+	ping_pong_t ping_pong =
+	{
+		.ping_events = heap_alloc(bench->heap, sizeof(event_t*) * k_bench_ping_pong_rounds, 8),
+		.pong_events = heap_alloc(bench->heap, sizeof(event_t*) * k_bench_ping_pong_rounds, 8),
+		.latencies = heap_alloc(bench->heap, sizeof(uint64_t) * k_bench_ping_pong_rounds, 8),
+	};
+	for (int i = 0; i < k_bench_ping_pong_rounds; ++i)
+	{
+		ping_pong.ping_events[i] = event_create(bench->heap);
+		ping_pong.pong_events[i] = event_create(bench->heap);
+	}
+
+	thread_t* thread = thread_create(event_pong_func, &ping_pong);
+
+	uint64_t start_ticks = timer_get_ticks();
+	for (int i = 0; i < k_bench_ping_pong_rounds; ++i)
+	{
+		ping_pong.stamp = timer_get_ticks();
+		event_signal(ping_pong.ping_events[i]);
+		event_wait(ping_pong.pong_events[i]);
+	}
+	uint64_t ticks = timer_get_ticks() - start_ticks;
+	thread_destroy(thread);
+
+	bench_result_t* result = bench_add_result(bench, "event", 1, 1, k_bench_ping_pong_rounds, ticks);
+	bench_set_latency(result, ping_pong.latencies, k_bench_ping_pong_rounds);
+
+	for (int i = 0; i < k_bench_ping_pong_rounds; ++i)
+	{
+		event_destroy(ping_pong.ping_events[i]);
+		event_destroy(ping_pong.pong_events[i]);
+	}
+	heap_free(bench->heap, ping_pong.latencies);
+	heap_free(bench->heap, ping_pong.pong_events);
+	heap_free(bench->heap, ping_pong.ping_events);
+}
+
+static void bench_empty_job(void* data)
+{
+}
+
+// Submits every job from inside a job, so they go through a worker's deque
+// and reach other workers by stealing.
+static void bench_spawn_job(void* data)
+{
+	bench_t* bench = data;
+	job_counter_t* counter = job_counter_create(bench->jobs);
+	for (int i = 0; i < k_bench_job_count; ++i)
+	{
+		job_run(bench->jobs, bench_empty_job, NULL, counter);
+	}
+	job_wait(bench->jobs, counter);
+	job_counter_destroy(bench->jobs, counter);
+}
+
+// Measure job overhead: submitting, scheduling and completing empty jobs.
+static void run_job_tests(bench_t* bench)
+{
+	int thread_count = job_system_get_thread_count(bench->jobs);
+	job_counter_t* counter = job_counter_create(bench->jobs);
+
+	// From this thread, through the shared queue.
+	uint64_t start_ticks = timer_get_ticks();
+	for (int i = 0; i < k_bench_job_count; ++i)
+	{
+		job_run(bench->jobs, bench_empty_job, NULL, counter);
+	}
+	job_wait(bench->jobs, counter);
+	bench_add_result(bench, "job_injected", 1, thread_count, k_bench_job_count, timer_get_ticks() - start_ticks);
+
+	start_ticks = timer_get_ticks();
+	job_run(bench->jobs, bench_spawn_job, bench, counter);
+	job_wait(bench->jobs, counter);
+	bench_add_result(bench, "job_stolen", 1, thread_count, k_bench_job_count, timer_get_ticks() - start_ticks);
+
+	job_counter_destroy(bench->jobs, counter);
+}
+
+// Log results and write them to a JSON file.
+static void bench_report(bench_t* bench, fs_t* fs, const char* path)
+{
+	char* json = heap_alloc(bench->heap, k_bench_json_capacity, 8);
+	int length = snprintf(json, k_bench_json_capacity, "{\n\t\"ticks_per_second\": %llu,\n\t\"results\": [",
+		timer_get_ticks_per_second());
+
+	for (int i = 0; i < bench->result_count; ++i)
+	{
+		bench_result_t* result = &bench->results[i];
+		double seconds = (double)result->ticks / (double)timer_get_ticks_per_second();
+		double operations_per_second = seconds > 0.0 ? (double)result->operations / seconds : 0.0;
+
+		debug_print(k_print_info, "%-20s producers=%d consumers=%d ops/s=%.0f p50=%lluns p99=%lluns\n",
+			result->name, result->producers, result->consumers, operations_per_second,
+			result->p50_ns, result->p99_ns);
+
+		char latency[64] = "null";
+		char latency99[64] = "null";
+		if (result->has_latency)
+		{
+			snprintf(latency, sizeof(latency), "%llu", result->p50_ns);
+			snprintf(latency99, sizeof(latency99), "%llu", result->p99_ns);
+		}
+		length += snprintf(json + length, k_bench_json_capacity - length,
+			"%s\n\t\t{\"name\": \"%s\", \"producers\": %d, \"consumers\": %d, \"operations\": %llu, "
+			"\"seconds\": %f, \"operations_per_second\": %f, \"p50_ns\": %s, \"p99_ns\": %s}",
+			i ? "," : "", result->name, result->producers, result->consumers, result->operations,
+			seconds, operations_per_second, latency, latency99);
+	}
+	length += snprintf(json + length, k_bench_json_capacity - length, "\n\t]\n}\n");
+
+	// The write reads from json, so wait for it before freeing.
+	fs_work_t* work = fs_write(fs, path, json, strlen(json), false);
+	fs_work_wait(work);
+	if (fs_work_get_result(work))
+	{
+		debug_print(k_print_error, "Failed to write benchmark results to %s.\n", path);
+	}
+	fs_work_destroy(work);
+	heap_free(bench->heap, json);
+}
+
+void bench_run(heap_t* heap, fs_t* fs, job_system_t* jobs, const char* path)
+{
+	bench_t* bench = heap_alloc(heap, sizeof(bench_t), 8);
+	bench->heap = heap;
+	bench->jobs = jobs;
+	bench->result_count = 0;
+
+	for (int threads = 1; threads <= k_bench_max_threads; threads *= 2)
+	{
+		run_counter_test(bench, no_synchronization_func, "no_synchronization", threads);
+		run_counter_test(bench, atomic_load_store_func, "atomic_load_store", threads);
+		run_counter_test(bench, atomic_increment_func, "atomic_increment", threads);
+		run_counter_test(bench, mutex_func, "mutex", threads);
+		run_counter_test(bench, mutex_table_func, "mutex_table", threads);
+		run_counter_test(bench, rwlock_table_func, "rwlock_table", threads);
+		run_counter_test(bench, seqlock_table_func, "seqlock_table", threads);
+	}
+
+	run_semaphore_test(bench);
+	run_event_test(bench);
+	run_job_tests(bench);
+
+	static const int k_queue_configs[][2] = { { 1, 1 }, { 2, 2 }, { 4, 4 }, { 1, 4 }, { 4, 1 } };
+	for (int i = 0; i < _countof(k_queue_configs); ++i)
+	{
+		queue_t* queue = queue_create(heap, k_bench_queue_capacity);
+		run_handoff_test(bench, "queue", queue, queue_push_wrapper, queue_pop_wrapper,
+			k_queue_configs[i][0], k_queue_configs[i][1]);
+		queue_destroy(queue);
+	}
+
+	queue_spsc_t* spsc = queue_spsc_create(heap, k_bench_queue_capacity);
+	run_handoff_test(bench, "queue_spsc", spsc, queue_spsc_push_wrapper, queue_spsc_pop_wrapper, 1, 1);
+	queue_spsc_destroy(spsc);
+
+	bench_report(bench, fs, path);
+	heap_free(heap, bench);
+}
@@ -0,0 +1,19 @@
+#pragma once
+
+// Synchronization benchmarks
+//
+// Times the engine's synchronization primitives so alternative
+// implementations can be compared against the current ones.
+// Counter tests measure throughput of mutex_t and atomic_* on 1 to 8 threads,
+// and table tests compare mutex_t, rwlock_t and seqlock_t on read-mostly data.
+// Handoff tests measure throughput and p50/p99 latency from push to pop for
+// queue_t and queue_spsc_t under several producer/consumer counts, and from
+// signal to wake for semaphore_t and event_t. Job tests measure the cost of
+// scheduling empty jobs on job_system_t.
+
+typedef struct fs_t fs_t;
+typedef struct heap_t heap_t;
+typedef struct job_system_t job_system_t;
+
+// Run all benchmarks, log a summary, and write the results as JSON to path.
+void bench_run(heap_t* heap, fs_t* fs, job_system_t* jobs, const char* path);
@@ -1,14 +1,23 @@
 #include "ecs.h"
 
+#include "atomic.h"
 #include "debug.h"
 #include "heap.h"
+#include "job.h"
+#include "mutex.h"
 
+#include <stdlib.h>
 #include <string.h>
 
 enum
 {
 	k_max_component_types = 64,
 	k_max_entities = 512,
+	k_max_archetypes = 64,
+
+	// Bytes in a chunk of archetype storage, unless one entity needs more.
+	k_ecs_chunk_size = 16 * 1024,
+	k_ecs_chunk_alignment = 64,
 };
 
 typedef enum entity_state_t
@@ -19,6 +28,26 @@ typedef enum entity_state_t
 	k_entity_pending_remove,
 } entity_state_t;
 
+// Storage for all entities with one component mask.
+// Rows are numbered across chunks; each chunk holds an array of entity indices,
+// then one array per component, each rows_per_chunk long.
+typedef struct ecs_archetype_t
+{
+	uint64_t component_mask;
+	size_t column_offsets[k_max_component_types];
+	int rows_per_chunk;
+	size_t chunk_size;
+
+	// Rows of active entities and entities pending removal, visited by queries.
+	int count;
+	// Rows including entities pending add, which follow the counted rows.
+	int reserved;
+
+	char** chunks;
+	int chunk_count;
+	int chunk_capacity;
+} ecs_archetype_t;
+
 typedef struct ecs_t
 {
 	heap_t* heap;
@@ -26,36 +55,102 @@ typedef struct ecs_t
 
 	int sequences[k_max_entities];
 	entity_state_t entity_states[k_max_entities];
-	uint64_t component_masks[k_max_entities];
+	int entity_archetypes[k_max_entities];
+	int entity_rows[k_max_entities];
+
+	// Guards archetype creation and row reservation, so entities can be
+	// spawned from parallel query callbacks.
+	mutex_t* mutex;
+	ecs_archetype_t* archetypes[k_max_archetypes];
+	int archetype_count;
 
-	void* components[k_max_component_types];
+	int component_type_count;
 	size_t component_type_sizes[k_max_component_types];
+	size_t component_type_alignments[k_max_component_types];
 	char component_type_names[k_max_component_types][32];
 } ecs_t;
 
+// One job's share of a parallel query.
+typedef struct ecs_query_job_t
+{
+	ecs_t* ecs;
+	ecs_query_t query;
+	ecs_query_func_t func;
+	void* user;
+} ecs_query_job_t;
+
 ecs_t* ecs_create(heap_t* heap)
 {
-	ecs_t* ecs = heap_alloc(heap, sizeof(ecs_t), 8);
+	ecs_t* ecs = heap_alloc_tagged(heap, sizeof(ecs_t), 8, k_heap_tag_ecs);
 	memset(ecs, 0, sizeof(*ecs));
 	ecs->heap = heap;
 	ecs->global_sequence = 1;
+	ecs->mutex = mutex_create();
+	mutex_set_name(ecs->mutex, "ecs");
 	return ecs;
 }
 
 void ecs_destroy(ecs_t* ecs)
 {
-	for (int i = 0; i < _countof(ecs->components); ++i)
+	for (int i = 0; i < ecs->archetype_count; ++i)
 	{
-		if (ecs->components[i])
+		ecs_archetype_t* archetype = ecs->archetypes[i];
+		for (int c = 0; c < archetype->chunk_count; ++c)
 		{
-			heap_free(ecs->heap, ecs->components[i]);
+			heap_free(ecs->heap, archetype->chunks[c]);
 		}
+		heap_free(ecs->heap, archetype->chunks);
+		heap_free(ecs->heap, archetype);
 	}
+	mutex_destroy(ecs->mutex);
 	heap_free(ecs->heap, ecs);
 }
 
+static char* ecs_archetype_get_row_component(ecs_t* ecs, ecs_archetype_t* archetype, int row, int component_type)
+{
+	char* chunk = archetype->chunks[row / archetype->rows_per_chunk];
+	size_t index = row % archetype->rows_per_chunk;
+	return chunk + archetype->column_offsets[component_type] + ecs->component_type_sizes[component_type] * index;
+}
+
+static int* ecs_archetype_get_row_entity(ecs_archetype_t* archetype, int row)
+{
+	int* entities = (int*)archetype->chunks[row / archetype->rows_per_chunk];
+	return &entities[row % archetype->rows_per_chunk];
+}
+
+// Fill a row with the last row, so the counted rows stay packed.
+static void ecs_archetype_remove_row(ecs_t* ecs, ecs_archetype_t* archetype, int row)
+{
+	int last = --archetype->count;
+	--archetype->reserved;
+	if (row == last)
+	{
+		return;
+	}
+
+	int moved_entity = *ecs_archetype_get_row_entity(archetype, last);
+	*ecs_archetype_get_row_entity(archetype, row) = moved_entity;
+	for (int i = 0; i < ecs->component_type_count; ++i)
+	{
+		if (archetype->component_mask & (1ULL << i))
+		{
+			memcpy(ecs_archetype_get_row_component(ecs, archetype, row, i),
+				ecs_archetype_get_row_component(ecs, archetype, last, i),
+				ecs->component_type_sizes[i]);
+		}
+	}
+	ecs->entity_rows[moved_entity] = row;
+}
+
 void ecs_update(ecs_t* ecs)
 {
+	// Entities spawned since the last update already have rows after the counted ones.
+	for (int i = 0; i < ecs->archetype_count; ++i)
+	{
+		ecs->archetypes[i]->count = ecs->archetypes[i]->reserved;
+	}
+
 	for (int i = 0; i < _countof(ecs->entity_states); ++i)
 	{
 		if (ecs->entity_states[i] == k_entity_pending_add)
@@ -64,24 +159,33 @@ void ecs_update(ecs_t* ecs)
 		}
 		else if (ecs->entity_states[i] == k_entity_pending_remove)
 		{
+			ecs_archetype_remove_row(ecs, ecs->archetypes[ecs->entity_archetypes[i]], ecs->entity_rows[i]);
 			ecs->entity_states[i] = k_entity_unused;
 		}
 	}
+
+	// Give back chunks that emptied out.
+	for (int i = 0; i < ecs->archetype_count; ++i)
+	{
+		ecs_archetype_t* archetype = ecs->archetypes[i];
+		int chunks_needed = (archetype->count + archetype->rows_per_chunk - 1) / archetype->rows_per_chunk;
+		while (archetype->chunk_count > chunks_needed)
+		{
+			heap_free(ecs->heap, archetype->chunks[--archetype->chunk_count]);
+		}
+	}
 }
 
 int ecs_register_component_type(ecs_t* ecs, const char* name, size_t size_per_component, size_t alignment)
 {
-	for (int i = 0; i < _countof(ecs->components); ++i)
+	if (ecs->component_type_count < k_max_component_types)
 	{
-		if (ecs->components[i] == NULL)
-		{
-			size_t aligned_size = (size_per_component + (alignment - 1)) & ~(alignment - 1);
-			strcpy_s(ecs->component_type_names[i], sizeof(ecs->component_type_names[i]), name);
-			ecs->component_type_sizes[i] = aligned_size;
-			ecs->components[i] = heap_alloc(ecs->heap, aligned_size * k_max_entities, alignment);
-			memset(ecs->components[i], 0, aligned_size * k_max_entities);
-			return i;
-		}
+		int i = ecs->component_type_count++;
+		size_t aligned_size = (size_per_component + (alignment - 1)) & ~(alignment - 1);
+		strcpy_s(ecs->component_type_names[i], sizeof(ecs->component_type_names[i]), name);
+		ecs->component_type_sizes[i] = aligned_size;
+		ecs->component_type_alignments[i] = alignment;
+		return i;
 	}
 	debug_print(k_print_warning, "Out of component types.");
 	return -1;
@@ -92,15 +196,109 @@ size_t ecs_get_component_type_size(ecs_t* ecs, int component_type)
 	return ecs->component_type_sizes[component_type];
 }
 
+// Place the arrays of a chunk holding rows entities. Returns the chunk size.
+static size_t ecs_archetype_layout(ecs_t* ecs, ecs_archetype_t* archetype, int rows)
+{
+	size_t offset = sizeof(int) * rows;
+	for (int i = 0; i < ecs->component_type_count; ++i)
+	{
+		if (archetype->component_mask & (1ULL << i))
+		{
+			size_t alignment = ecs->component_type_alignments[i];
+			offset = (offset + (alignment - 1)) & ~(alignment - 1);
+			archetype->column_offsets[i] = offset;
+			offset += ecs->component_type_sizes[i] * rows;
+		}
+	}
+	return offset;
+}
+
+// Find the archetype for a component mask, creating it if needed.
+// Returns -1 if there are too many archetypes. Called with the mutex held.
+static int ecs_archetype_get(ecs_t* ecs, uint64_t component_mask)
+{
+	for (int i = 0; i < ecs->archetype_count; ++i)
+	{
+		if (ecs->archetypes[i]->component_mask == component_mask)
+		{
+			return i;
+		}
+	}
+	if (ecs->archetype_count == k_max_archetypes)
+	{
+		return -1;
+	}
+
+	ecs_archetype_t* archetype = heap_alloc_tagged(ecs->heap, sizeof(ecs_archetype_t), 8, k_heap_tag_ecs);
+	memset(archetype, 0, sizeof(*archetype));
+	archetype->component_mask = component_mask;
+
+	// Fit as many rows as alignment padding allows, but always at least one.
+	size_t row_size = sizeof(int);
+	for (int i = 0; i < ecs->component_type_count; ++i)
+	{
+		if (component_mask & (1ULL << i))
+		{
+			row_size += ecs->component_type_sizes[i];
+		}
+	}
+	int rows = (int)__min(k_ecs_chunk_size / row_size, k_max_entities);
+	while (rows > 1 && ecs_archetype_layout(ecs, archetype, rows) > k_ecs_chunk_size)
+	{
+		--rows;
+	}
+	rows = __max(rows, 1);
+	archetype->rows_per_chunk = rows;
+	archetype->chunk_size = ecs_archetype_layout(ecs, archetype, rows);
+
+	// Chunk pointers never move, so parallel callbacks can spawn entities
+	// while other callbacks read chunks.
+	archetype->chunk_capacity = (k_max_entities + rows - 1) / rows;
+	archetype->chunks = heap_alloc_tagged(ecs->heap, sizeof(char*) * archetype->chunk_capacity, 8, k_heap_tag_ecs);
+
+	ecs->archetypes[ecs->archetype_count] = archetype;
+	return ecs->archetype_count++;
+}
+
 ecs_entity_ref_t ecs_entity_add(ecs_t* ecs, uint64_t component_mask)
 {
 	for (int i = 0; i < _countof(ecs->entity_states); ++i)
 	{
-		if (ecs->entity_states[i] == k_entity_unused)
+		// Claim the slot atomically so parallel query callbacks can spawn entities.
+		// Queries skip pending entities, so nobody reads the slot until ecs_update.
+		if (ecs->entity_states[i] == k_entity_unused &&
+			atomic_compare_and_exchange((int*)&ecs->entity_states[i], k_entity_unused, k_entity_pending_add) == k_entity_unused)
 		{
-			ecs->entity_states[i] = k_entity_pending_add;
-			ecs->sequences[i] = ecs->global_sequence++;
-			ecs->component_masks[i] = component_mask;
+			// Reserve a row past the ones queries visit.
+			mutex_lock(ecs->mutex);
+			int archetype_index = ecs_archetype_get(ecs, component_mask);
+			if (archetype_index < 0)
+			{
+				mutex_unlock(ecs->mutex);
+				ecs->entity_states[i] = k_entity_unused;
+				debug_print(k_print_warning, "Out of archetypes.");
+				return (ecs_entity_ref_t) { .entity = -1, .sequence = -1 };
+			}
+			ecs_archetype_t* archetype = ecs->archetypes[archetype_index];
+			int row = archetype->reserved++;
+			if (row / archetype->rows_per_chunk == archetype->chunk_count)
+			{
+				archetype->chunks[archetype->chunk_count++] = heap_alloc_tagged(ecs->heap, archetype->chunk_size, k_ecs_chunk_alignment, k_heap_tag_ecs);
+			}
+			mutex_unlock(ecs->mutex);
+
+			*ecs_archetype_get_row_entity(archetype, row) = i;
+			for (int c = 0; c < ecs->component_type_count; ++c)
+			{
+				if (component_mask & (1ULL << c))
+				{
+					memset(ecs_archetype_get_row_component(ecs, archetype, row, c), 0, ecs->component_type_sizes[c]);
+				}
+			}
+
+			ecs->entity_archetypes[i] = archetype_index;
+			ecs->entity_rows[i] = row;
+			ecs->sequences[i] = atomic_increment(&ecs->global_sequence);
 			return (ecs_entity_ref_t) { .entity = i, .sequence = ecs->sequences[i] };
 		}
 	}
@@ -129,46 +327,133 @@ bool ecs_is_entity_ref_valid(ecs_t* ecs, ecs_entity_ref_t ref, bool allow_pendin
 
 void* ecs_entity_get_component(ecs_t* ecs, ecs_entity_ref_t ref, int component_type, bool allow_pending_add)
 {
-	if (ecs_is_entity_ref_valid(ecs, ref, allow_pending_add) && ecs->components[component_type])
+	if (ecs_is_entity_ref_valid(ecs, ref, allow_pending_add))
 	{
-		char* components = ecs->components[component_type];
-		return &components[ecs->component_type_sizes[component_type] * ref.entity];
+		ecs_archetype_t* archetype = ecs->archetypes[ecs->entity_archetypes[ref.entity]];
+		if (archetype->component_mask & (1ULL << component_type))
+		{
+			return ecs_archetype_get_row_component(ecs, archetype, ecs->entity_rows[ref.entity], component_type);
+		}
 	}
 	return NULL;
 }
 
 ecs_query_t ecs_query_create(ecs_t* ecs, uint64_t mask)
 {
-	ecs_query_t query = { .component_mask = mask, .entity = -1 };
+	ecs_query_t query = { .component_mask = mask, .archetype = 0, .row = -1, .row_end = -1 };
 	ecs_query_next(ecs, &query);
 	return query;
 }
 
 bool ecs_query_is_valid(ecs_t* ecs, ecs_query_t* query)
 {
-	return query->entity >= 0;
+	return query->archetype >= 0;
 }
 
 void ecs_query_next(ecs_t* ecs, ecs_query_t* query)
 {
-	for (int i = query->entity + 1; i < _countof(ecs->component_masks); ++i)
+	if (query->archetype < 0)
+	{
+		return;
+	}
+
+	++query->row;
+	if (query->row_end >= 0)
 	{
-		if ((ecs->component_masks[i] & query->component_mask) == query->component_mask && ecs->entity_states[i] >= k_entity_active)
+		if (query->row >= query->row_end)
+		{
+			query->archetype = -1;
+		}
+		return;
+	}
+
+	for (; query->archetype < ecs->archetype_count; ++query->archetype, query->row = 0)
+	{
+		ecs_archetype_t* archetype = ecs->archetypes[query->archetype];
+		if ((archetype->component_mask & query->component_mask) == query->component_mask && query->row < archetype->count)
 		{
-			query->entity = i;
 			return;
 		}
 	}
-	query->entity = -1;
+	query->archetype = -1;
 }
 
 void* ecs_query_get_component(ecs_t* ecs, ecs_query_t* query, int component_type)
 {
-	char* components = ecs->components[component_type];
-	return &components[ecs->component_type_sizes[component_type] * query->entity];
+	return ecs_archetype_get_row_component(ecs, ecs->archetypes[query->archetype], query->row, component_type);
 }
 
 ecs_entity_ref_t ecs_query_get_entity(ecs_t* ecs, ecs_query_t* query)
 {
-	return (ecs_entity_ref_t) { .entity = query->entity, .sequence = ecs->sequences[query->entity] };
+	int entity = *ecs_archetype_get_row_entity(ecs->archetypes[query->archetype], query->row);
+	return (ecs_entity_ref_t) { .entity = entity, .sequence = ecs->sequences[entity] };
+}
+
+static void ecs_query_job(void* data)
+{
+	ecs_query_job_t* job = data;
+	job->func(job->ecs, &job->query, job->user);
+}
+
+void ecs_query_for_each_parallel(ecs_t* ecs, job_system_t* jobs, uint64_t mask, int chunk_size, ecs_query_func_t func, void* user)
+{
+	// Callbacks may add archetypes, so only look at the ones that exist now.
+	int archetype_count = ecs->archetype_count;
+
+	// Runs never cross storage chunks.
+	int job_count = 0;
+	for (int i = 0; i < archetype_count; ++i)
+	{
+		ecs_archetype_t* archetype = ecs->archetypes[i];
+		if ((archetype->component_mask & mask) == mask)
+		{
+			int run_size = chunk_size > 0 ? __min(chunk_size, archetype->rows_per_chunk) : archetype->rows_per_chunk;
+			int runs_per_chunk = (archetype->rows_per_chunk + run_size - 1) / run_size;
+			int full_chunks = archetype->count / archetype->rows_per_chunk;
+			int last_rows = archetype->count % archetype->rows_per_chunk;
+			job_count += full_chunks * runs_per_chunk + (last_rows + run_size - 1) / run_size;
+		}
+	}
+	if (job_count == 0)
+	{
+		return;
+	}
+
+	ecs_query_job_t* query_jobs = heap_alloc_tagged(ecs->heap, sizeof(ecs_query_job_t) * job_count, 8, k_heap_tag_ecs);
+	job_counter_t* counter = job_counter_create(jobs);
+
+	int job_index = 0;
+	for (int i = 0; i < archetype_count; ++i)
+	{
+		ecs_archetype_t* archetype = ecs->archetypes[i];
+		if ((archetype->component_mask & mask) != mask)
+		{
+			continue;
+		}
+
+		int run_size = chunk_size > 0 ? __min(chunk_size, archetype->rows_per_chunk) : archetype->rows_per_chunk;
+		for (int chunk_start = 0; chunk_start < archetype->count; chunk_start += archetype->rows_per_chunk)
+		{
+			int chunk_end = __min(chunk_start + archetype->rows_per_chunk, archetype->count);
+			for (int row = chunk_start; row < chunk_end; row += run_size)
+			{
+				ecs_query_job_t* job = &query_jobs[job_index++];
+				job->ecs = ecs;
+				job->func = func;
+				job->user = user;
+				job->query = (ecs_query_t)
+				{
+					.component_mask = mask,
+					.archetype = i,
+					.row = row,
+					.row_end = __min(row + run_size, chunk_end),
+				};
+				job_run(jobs, ecs_query_job, job, counter);
+			}
+		}
+	}
+
+	job_wait(jobs, counter);
+	job_counter_destroy(jobs, counter);
+	heap_free(ecs->heap, query_jobs);
 }
@@ -2,11 +2,16 @@
 
 // Entity Component System
 // Framework for game entities and their components.
+//
+// Entities with the same set of components share an archetype, which stores
+// them packed into fixed-size chunks with one array per component. Queries
+// only visit archetypes that match, and walk their components in order.
 
 #include <stdbool.h>
 #include <stdint.h>
 
 typedef struct heap_t heap_t;
+typedef struct job_system_t job_system_t;
 
 // Handle to an entity component system interface.
 typedef struct ecs_t ecs_t;
@@ -22,9 +27,18 @@ typedef struct ecs_entity_ref_t
 typedef struct ecs_query_t
 {
 	uint64_t component_mask;
-	int entity;
+	// Archetype and row of the current entity. Archetype is -1 once the query is done.
+	int archetype;
+	int row;
+	// If not negative, the query stops at this row instead of moving on to other archetypes.
+	int row_end;
 } ecs_query_t;
 
+// Callback for ecs_query_for_each_parallel.
+// Visits one run of matching entities with the usual query loop:
+//   for (; ecs_query_is_valid(ecs, query); ecs_query_next(ecs, query)) { ... }
+typedef void (*ecs_query_func_t)(ecs_t* ecs, ecs_query_t* query, void* user);
+
 // Create an entity component system.
 ecs_t* ecs_create(heap_t* heap);
 
@@ -41,10 +55,14 @@ int ecs_register_component_type(ecs_t* ecs, const char* name, size_t size_per_co
 size_t ecs_get_component_type_size(ecs_t* ecs, int component_type);
 
 // Spawn an entity with the masked components and return a reference to it.
+// Its components start zeroed. The entity becomes visible to queries at the next ecs_update.
+// Safe to call from ecs_query_for_each_parallel callbacks.
 ecs_entity_ref_t ecs_entity_add(ecs_t* ecs, uint64_t component_mask);
 
 // Destroy an entity.
 // If allow_pending_add is true, can destroy an entity that is not fully spawned.
+// The entity stays visible to queries until the next ecs_update.
+// Safe to call from ecs_query_for_each_parallel callbacks.
 void ecs_entity_remove(ecs_t* ecs, ecs_entity_ref_t ref, bool allow_pending_add);
 
 // Determines if a entity reference points to a valid entity.
@@ -54,6 +72,7 @@ bool ecs_is_entity_ref_valid(ecs_t* ecs, ecs_entity_ref_t ref, bool allow_pendin
 // Get the memory for a component on an entity.
 // NULL is returned if the entity is not valid or the component_type is not present on the entity.
 // If allow_pending_add is true, will return component data for not fully spawned entities.
+// Component memory may move at the next ecs_update, so don't keep the pointer past it.
 void* ecs_entity_get_component(ecs_t* ecs, ecs_entity_ref_t ref, int component_type, bool allow_pending_add);
 
 // Creates a new entity query by component type mask.
@@ -70,3 +89,11 @@ void* ecs_query_get_component(ecs_t* ecs, ecs_query_t* query, int component_type
 
 // Get a entity reference for the current query location.
 ecs_entity_ref_t ecs_query_get_entity(ecs_t* ecs, ecs_query_t* query);
+
+// Runs func on every entity matching mask, in parallel on the job system.
+// Each storage chunk of a matching archetype is split into runs of up to
+// chunk_size entities (the whole chunk if zero or less), and each run becomes
+// a job. Returns once all runs are done; the calling thread helps run them.
+// Callbacks for different runs run concurrently, so they may only write
+// components of the entities they visit.
+void ecs_query_for_each_parallel(ecs_t* ecs, job_system_t* jobs, uint64_t mask, int chunk_size, ecs_query_func_t func, void* user);
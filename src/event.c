@@ -1,30 +1,103 @@
 #include "event.h"
 
+#include "heap.h"
+#include "lock_profile.h"
+#include "timer.h"
+
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
 
-event_t* event_create()
+#pragma comment(lib, "Synchronization.lib")
+
+enum
+{
+	k_event_clear,
+	k_event_raised,
+	// Not raised and at least one thread may be parked on the state word.
+	k_event_waiting,
+
+	// Spins before a waiter parks; work is often nearly done when first waited on.
+	k_event_spin_count = 64,
+};
+
+event_t* event_create(heap_t* heap)
 {
-	HANDLE evt = CreateEvent(NULL, TRUE, FALSE, NULL);
-	return (event_t*)evt;
+	event_t* event = heap_alloc(heap, sizeof(event_t), 8);
+	event_init(event);
+	event->heap = heap;
+	return event;
 }
 
 void event_destroy(event_t* event)
 {
-	CloseHandle(event);
+	heap_free(event->heap, event);
+}
+
+void event_init(event_t* event)
+{
+	event->state = k_event_clear;
+	event->profile = NULL;
+	event->heap = NULL;
+}
+
+void event_set_name(event_t* event, const char* name)
+{
+	event->profile = lock_profile_get(name);
 }
 
 void event_signal(event_t* event)
 {
-	SetEvent(event);
+	// Only enter the kernel when someone is parked.
+	// The waiter may free or reuse the event as soon as it sees it raised; waking
+	// a stale address is harmless since WaitOnAddress only uses it as a key and
+	// woken waiters recheck the state.
+	if (InterlockedExchange(&event->state, k_event_raised) == k_event_waiting)
+	{
+		WakeByAddressAll(&event->state);
+	}
+}
+
+static void event_wait_contended(event_t* event)
+{
+	for (int spins = 0; spins < k_event_spin_count; ++spins)
+	{
+		YieldProcessor();
+		if (*(volatile LONG*)&event->state == k_event_raised)
+		{
+			return;
+		}
+	}
+
+	while (true)
+	{
+		LONG state = InterlockedCompareExchange(&event->state, k_event_waiting, k_event_clear);
+		if (state == k_event_raised)
+		{
+			return;
+		}
+		LONG waiting = k_event_waiting;
+		WaitOnAddress(&event->state, &waiting, sizeof(waiting), INFINITE);
+	}
 }
 
 void event_wait(event_t* event)
 {
-	WaitForSingleObject(event, INFINITE);
+	// Waiting on an event that is already raised is not contention.
+	bool contended = *(volatile LONG*)&event->state != k_event_raised;
+	uint64_t wait_start = 0;
+	if (contended)
+	{
+		wait_start = event->profile ? timer_get_ticks() : 0;
+		event_wait_contended(event);
+	}
+
+	if (event->profile && lock_profile_is_recording())
+	{
+		lock_profile_acquired(event->profile, contended, wait_start);
+	}
 }
 
 bool event_is_raised(event_t* event)
 {
-	return WaitForSingleObject(event, 0) == WAIT_OBJECT_0;
+	return *(volatile LONG*)&event->state == k_event_raised;
 }
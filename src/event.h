@@ -2,17 +2,35 @@
 
 #include <stdbool.h>
 
-// Event thread synchronization
+typedef struct heap_t heap_t;
 
-// Handle to an event.
-typedef struct event_t event_t;
+// Event thread synchronization
+//
+// Events are a single atomic word; only waiting on an unsignaled event sleeps.
+
+// An event. The fields are private; the type is complete only so events
+// can be embedded in other objects and set up with event_init.
+typedef struct event_t
+{
+	long state;
+	struct lock_profile_t* profile;
+	heap_t* heap;
+} event_t;
 
 // Creates a new event.
-event_t* event_create();
+event_t* event_create(heap_t* heap);
 
 // Destroys a previously created event.
 void event_destroy(event_t* event);
 
+// Sets up an embedded event, unsignaled and unnamed.
+// Also resets an embedded event for reuse once nobody waits on it.
+// Embedded events need no destroy.
+void event_init(event_t* event);
+
+// Names an event for lock contention profiling. See lock_profile.h.
+void event_set_name(event_t* event, const char* name);
+
 // Signals an event.
 // All threads waiting on this event will resume.
 void event_signal(event_t* event);
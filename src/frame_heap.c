@@ -0,0 +1,67 @@
+#include "frame_heap.h"
+
+#include "debug.h"
+#include "heap.h"
+#include "semaphore.h"
+
+#include <stdint.h>
+
+typedef struct frame_heap_t
+{
+	heap_t* heap;
+	semaphore_t* free_frames;
+	char* base;
+	size_t frame_capacity;
+	int frame_count;
+	int frame_index;
+	char* cursor;
+	char* end;
+} frame_heap_t;
+
+frame_heap_t* frame_heap_create(heap_t* heap, size_t frame_capacity, int frame_count)
+{
+	frame_heap_t* frame_heap = heap_alloc(heap, sizeof(frame_heap_t), 8);
+	frame_heap->heap = heap;
+	frame_heap->free_frames = semaphore_create(heap, frame_count, frame_count);
+	semaphore_set_name(frame_heap->free_frames, "frame heap");
+	frame_heap->base = heap_alloc(heap, frame_capacity * frame_count, 16);
+	frame_heap->frame_capacity = frame_capacity;
+	frame_heap->frame_count = frame_count;
+	frame_heap->frame_index = -1;
+	frame_heap->cursor = NULL;
+	frame_heap->end = NULL;
+	return frame_heap;
+}
+
+void frame_heap_destroy(frame_heap_t* frame_heap)
+{
+	semaphore_destroy(frame_heap->free_frames);
+	heap_free(frame_heap->heap, frame_heap->base);
+	heap_free(frame_heap->heap, frame_heap);
+}
+
+void frame_heap_begin(frame_heap_t* frame_heap)
+{
+	semaphore_acquire(frame_heap->free_frames);
+
+	frame_heap->frame_index = (frame_heap->frame_index + 1) % frame_heap->frame_count;
+	frame_heap->cursor = frame_heap->base + frame_heap->frame_capacity * frame_heap->frame_index;
+	frame_heap->end = frame_heap->cursor + frame_heap->frame_capacity;
+}
+
+void* frame_heap_alloc(frame_heap_t* frame_heap, size_t size, size_t alignment)
+{
+	uintptr_t address = ((uintptr_t)frame_heap->cursor + (alignment - 1)) & ~(uintptr_t)(alignment - 1);
+	if (!frame_heap->cursor || address + size > (uintptr_t)frame_heap->end)
+	{
+		debug_print(k_print_warning, "Frame heap exhausted!\n");
+		return NULL;
+	}
+	frame_heap->cursor = (char*)(address + size);
+	return (void*)address;
+}
+
+void frame_heap_retire(frame_heap_t* frame_heap)
+{
+	semaphore_release(frame_heap->free_frames);
+}
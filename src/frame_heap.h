@@ -0,0 +1,39 @@
+#pragma once
+
+#include <stddef.h>
+
+// Frame Heap
+//
+// Linear (bump) allocator for memory that only lives for one frame.
+// Memory is split into a ring of frame buffers. Allocations bump a pointer
+// in the current frame's buffer and are never freed individually; the whole
+// buffer is released at once when its frame retires.
+//
+// One thread begins frames and allocates, another may consume the memory
+// and retire frames once it is done with them.
+
+// Handle to a frame heap.
+typedef struct frame_heap_t frame_heap_t;
+
+typedef struct heap_t heap_t;
+
+// Create a frame heap with frame_count buffers of frame_capacity bytes each.
+// Use 2 for double buffering, 3 for triple buffering.
+frame_heap_t* frame_heap_create(heap_t* heap, size_t frame_capacity, int frame_count);
+
+// Destroy a previously created frame heap.
+void frame_heap_destroy(frame_heap_t* frame_heap);
+
+// Begin a new frame.
+// If all frame buffers are still in flight, blocks until the oldest retires.
+// The new frame's buffer is reset.
+void frame_heap_begin(frame_heap_t* frame_heap);
+
+// Allocate memory from the current frame.
+// Returns NULL if the current frame's buffer is exhausted.
+// Not safe for multiple threads to allocate at the same time.
+void* frame_heap_alloc(frame_heap_t* frame_heap, size_t size, size_t alignment);
+
+// Retire the oldest in-flight frame, releasing all of its memory.
+// Safe to call from a different thread than the one beginning frames.
+void frame_heap_retire(frame_heap_t* frame_heap);
@@ -2,18 +2,31 @@
 
 #include "event.h"
 #include "heap.h"
+#include "object_pool.h"
 #include "queue.h"
 #include "thread.h"
 #include "lz4/lz4.h"
 
+#include <limits.h>
 #include <string.h>
 
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
 
+enum
+{
+	// Work objects are recycled through a pool; beyond this many in flight they come from the heap.
+	k_fs_max_work = 64,
+
+	// Work items, queues and compression buffers come from a child heap of this size.
+	// Buffers returned by fs_read come from the caller's heap instead.
+	k_fs_heap_budget = 64 * 1024 * 1024,
+};
+
 typedef struct fs_t
 {
 	heap_t* heap;
+	object_pool_t* work_pool;
 	queue_t* file_queue;
 	queue_t* comp_decomp_queue; // queue for compression and decompression
 	thread_t* file_thread;
@@ -29,13 +42,14 @@ typedef enum fs_work_op_t
 typedef struct fs_work_t
 {
 	heap_t* heap;
+	object_pool_t* pool;
 	fs_work_op_t op;
 	char path[1024];
 	bool null_terminate;
 	bool use_compression;
 	void* buffer;
 	size_t size;
-	event_t* done;
+	event_t done;
 	int result;
 } fs_work_t;
 
@@ -44,12 +58,15 @@ static int comp_decomp_thread_func(void* user);
 
 fs_t* fs_create(heap_t* heap, int queue_capacity)
 {
-	fs_t* fs = heap_alloc(heap, sizeof(fs_t), 8);
+	heap = heap_create_child(heap, k_fs_heap_budget, k_heap_tag_fs, NULL, NULL);
+	fs_t* fs = heap_alloc_tagged(heap, sizeof(fs_t), 8, k_heap_tag_fs);
 	fs->heap = heap;
+	fs->work_pool = object_pool_create(heap, sizeof(fs_work_t), k_fs_max_work);
 	fs->file_queue = queue_create(heap, queue_capacity);
 	fs->comp_decomp_queue = queue_create(heap, queue_capacity); // creates compression and decompression queue
-	fs->file_thread = thread_create(file_thread_func, fs);
-	fs->comp_decomp_thread = thread_create(comp_decomp_thread_func, fs); // creates compression and decompression thread
+	// Background I/O and compression yield to the game and render threads.
+	fs->file_thread = thread_create_ex(file_thread_func, fs, &(thread_options_t) { .name = "fs file", .priority = k_thread_priority_low });
+	fs->comp_decomp_thread = thread_create_ex(comp_decomp_thread_func, fs, &(thread_options_t) { .name = "fs compression", .priority = k_thread_priority_lowest }); // creates compression and decompression thread
 	return fs;
 }
 
@@ -61,18 +78,23 @@ void fs_destroy(fs_t* fs)
 	thread_destroy(fs->comp_decomp_thread); // destroys compression and decompression thread
 	queue_destroy(fs->file_queue);
 	queue_destroy(fs->comp_decomp_queue); // destroys compression and decompression queue
-	heap_free(fs->heap, fs);
+	object_pool_destroy(fs->work_pool);
+	heap_t* heap = fs->heap;
+	heap_free(heap, fs);
+	heap_destroy(heap);
 }
 
 fs_work_t* fs_read(fs_t* fs, const char* path, heap_t* heap, bool null_terminate, bool use_compression)
 {
-	fs_work_t* work = heap_alloc(fs->heap, sizeof(fs_work_t), 8);
+	fs_work_t* work = object_pool_alloc(fs->work_pool);
 	work->heap = heap;
+	work->pool = fs->work_pool;
 	work->op = k_fs_work_op_read;
 	strcpy_s(work->path, sizeof(work->path), path);
 	work->buffer = NULL;
 	work->size = 0;
-	work->done = event_create();
+	event_init(&work->done);
+	event_set_name(&work->done, "fs work");
 	work->result = 0;
 	work->null_terminate = null_terminate;
 	work->use_compression = use_compression;
@@ -82,13 +104,15 @@ fs_work_t* fs_read(fs_t* fs, const char* path, heap_t* heap, bool null_terminate
 
 fs_work_t* fs_write(fs_t* fs, const char* path, const void* buffer, size_t size, bool use_compression)
 {
-	fs_work_t* work = heap_alloc(fs->heap, sizeof(fs_work_t), 8);
+	fs_work_t* work = object_pool_alloc(fs->work_pool);
 	work->heap = fs->heap;
+	work->pool = fs->work_pool;
 	work->op = k_fs_work_op_write;
 	strcpy_s(work->path, sizeof(work->path), path);
 	work->buffer = (void*)buffer;
 	work->size = size;
-	work->done = event_create();
+	event_init(&work->done);
+	event_set_name(&work->done, "fs work");
 	work->result = 0;
 	work->null_terminate = false;
 	work->use_compression = use_compression;
@@ -108,14 +132,14 @@ fs_work_t* fs_write(fs_t* fs, const char* path, const void* buffer, size_t size,
 
 bool fs_work_is_done(fs_work_t* work)
 {
-	return work ? event_is_raised(work->done) : true;
+	return work ? event_is_raised(&work->done) : true;
 }
 
 void fs_work_wait(fs_work_t* work)
 {
 	if (work)
 	{
-		event_wait(work->done);
+		event_wait(&work->done);
 	}
 }
 
@@ -141,9 +165,8 @@ void fs_work_destroy(fs_work_t* work)
 {
 	if (work)
 	{
-		event_wait(work->done);
-		event_destroy(work->done);
-		heap_free(work->heap, work);
+		event_wait(&work->done);
+		object_pool_free(work->pool, work);
 	}
 }
 
@@ -153,7 +176,7 @@ static void file_read(fs_work_t* work, fs_t* fs) // added arg for pushing onto t
 	if (MultiByteToWideChar(CP_UTF8, 0, work->path, -1, wide_path, sizeof(wide_path)) <= 0)
 	{
 		work->result = -1;
-		event_signal(work->done);
+		event_signal(&work->done);
 		return;
 	}
 
@@ -162,7 +185,7 @@ static void file_read(fs_work_t* work, fs_t* fs) // added arg for pushing onto t
 	if (handle == INVALID_HANDLE_VALUE)
 	{
 		work->result = GetLastError();
-		event_signal(work->done);
+		event_signal(&work->done);
 		return;
 	}
 
@@ -170,18 +193,20 @@ static void file_read(fs_work_t* work, fs_t* fs) // added arg for pushing onto t
 	{
 		work->result = GetLastError();
 		CloseHandle(handle);
-		event_signal(work->done);
+		event_signal(&work->done);
 		return;
 	}
 
-	work->buffer = heap_alloc(work->heap, work->null_terminate ? work->size + 1 : work->size, 8);
+	// Compressed data is only staged here; the caller's heap receives the decompressed result.
+	heap_t* heap = work->use_compression ? fs->heap : work->heap;
+	work->buffer = heap_alloc_tagged(heap, work->null_terminate ? work->size + 1 : work->size, 8, k_heap_tag_fs);
 
 	DWORD bytes_read = 0;
 	if (!ReadFile(handle, work->buffer, (DWORD)work->size, &bytes_read, NULL))
 	{
 		work->result = GetLastError();
 		CloseHandle(handle);
-		event_signal(work->done);
+		event_signal(&work->done);
 		return;
 	}
 
@@ -200,7 +225,7 @@ static void file_read(fs_work_t* work, fs_t* fs) // added arg for pushing onto t
 	}
 	else
 	{
-		event_signal(work->done);
+		event_signal(&work->done);
 	}
 }
 
@@ -210,7 +235,7 @@ static void file_write(fs_work_t* work)
 	if (MultiByteToWideChar(CP_UTF8, 0, work->path, -1, wide_path, sizeof(wide_path)) <= 0)
 	{
 		work->result = -1;
-		event_signal(work->done);
+		event_signal(&work->done);
 		return;
 	}
 
@@ -219,7 +244,7 @@ static void file_write(fs_work_t* work)
 	if (handle == INVALID_HANDLE_VALUE)
 	{
 		work->result = GetLastError();
-		event_signal(work->done);
+		event_signal(&work->done);
 		return;
 	}
 
@@ -228,7 +253,7 @@ static void file_write(fs_work_t* work)
 	{
 		work->result = GetLastError();
 		CloseHandle(handle);
-		event_signal(work->done);
+		event_signal(&work->done);
 		return;
 	}
 
@@ -236,7 +261,7 @@ static void file_write(fs_work_t* work)
 
 	CloseHandle(handle);
 
-	event_signal(work->done);
+	event_signal(&work->done);
 }
 
 static int file_thread_func(void* user)
@@ -278,22 +303,44 @@ static int comp_decomp_thread_func(void* user)
 		{
 		case k_fs_work_op_read:
 			{
-				int buffer_size = 1000000; // size of decompressed memory allocation
-				void* data = heap_alloc(fs->heap, buffer_size, 8); // allocate memory
+				// The decompressed size is not stored, so start from a guess and grow until it fits.
+				// LZ4 never expands data by more than 255x.
+				int max_size = (int)__min((size_t)work->size * 255 + 16, (size_t)INT_MAX - 1);
+				int buffer_size = (int)__min((size_t)work->size * 4 + 4096, (size_t)max_size);
+				void* data = heap_alloc_tagged(work->heap, buffer_size + 1, 8, k_heap_tag_fs); // +1 for null terminator
 				int decompressed_size = LZ4_decompress_safe((char*)work->buffer, data, (int)work->size, buffer_size); // decompress the file
+				while (decompressed_size < 0 && buffer_size < max_size)
+				{
+					int grow_size = (int)__min((size_t)buffer_size * 2, (size_t)max_size);
+					void* grown = heap_realloc(work->heap, data, grow_size + 1, 8);
+					if (!grown)
+					{
+						break;
+					}
+					data = grown;
+					buffer_size = grow_size;
+					decompressed_size = LZ4_decompress_safe((char*)work->buffer, data, (int)work->size, buffer_size);
+				}
+				decompressed_size = __max(decompressed_size, 0);
+				// Give back the unused tail; if that fails the larger block is still valid.
+				void* shrunk = heap_realloc(work->heap, data, decompressed_size + 1, 8);
+				if (shrunk)
+				{
+					data = shrunk;
+				}
 				heap_free(fs->heap, work->buffer); // free previous memory
 				work->buffer = data; // set buffer to decompressed file
 				work->size = decompressed_size; // setting the size to the decompressed size
 				if (work->null_terminate) {
 					((char*)work->buffer)[work->size] = '\0'; // if null terminate is true
 				}
-				event_signal(work->done); // Work is done
+				event_signal(&work->done); // Work is done
 				break;
 			}
 		case k_fs_work_op_write:
 			{
 				int buffer_size = LZ4_compressBound((int)work->size); // size of compressed file
-				void* data = heap_alloc(fs->heap, buffer_size, 8); // allocate memory for compressed file 
+				void* data = heap_alloc_tagged(fs->heap, buffer_size, 8, k_heap_tag_fs); // allocate memory for compressed file 
 				int compressed_size = LZ4_compress_default(work->buffer, data, (int)work->size, buffer_size); // compressing the file
 				work->buffer = data; // setting new data
 				work->size = compressed_size; // setting new size to compressed size
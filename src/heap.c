@@ -1,40 +1,228 @@
 #include "heap.h"
 
+#include "atomic.h"
 #include "debug.h"
 #include "mutex.h"
 #include "tlsf/tlsf.h"
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdio.h>
+#include <string.h>
 
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
 
+enum
+{
+	// Caches hold blocks of 16, 32, 64, 128, 256 and 512 bytes.
+	k_heap_cache_min_shift = 4,
+	k_heap_cache_class_count = 6,
+	k_heap_cache_max_size = 1 << (k_heap_cache_min_shift + k_heap_cache_class_count - 1),
+
+	// Maximum number of blocks a cache holds per size class.
+	k_heap_cache_capacity = 32,
+	// Number of blocks moved between a cache and TLSF under one lock.
+	k_heap_cache_batch = 8,
+	// Bytes all of a heap's caches may hold together, split evenly between them.
+	// Every fiber has its own cache, so without a cap a job system's fibers would
+	// each keep a full cache that heap_trim can't reach.
+	k_heap_cache_max_bytes = 1024 * 1024,
+
+	// On average one allocation is sampled per this many bytes allocated.
+	k_heap_default_sample_rate = 512 * 1024,
+	// Maximum number of live sampled allocations; must be a power of two.
+	k_heap_sample_capacity = 1024,
+	// Number of callstack frames recorded per sample.
+	k_heap_sample_depth = 12,
+	// Maximum number of distinct callstacks in a profile report.
+	k_heap_profile_max_sites = 64,
+
+	// An arena must be free for this many heap_trim() passes before it is released,
+	// so memory freed between two spikes is kept rather than remapped.
+	k_heap_trim_idle_passes = 3,
+
+	// Allocations at least this large bypass TLSF and map their own pages.
+	k_heap_large_size = 512 * 1024,
+	// Windows reserves address space in units of this size.
+	k_heap_large_granularity = 64 * 1024,
+};
+
+// Flags for heap_header_t.
+enum
+{
+	// Allocation has a record in the sample table.
+	k_heap_flag_sampled = 1 << 0,
+	// Allocation is mapped directly from the OS; see heap_large_t.
+	k_heap_flag_large = 1 << 1,
+};
+
 typedef struct arena_t
 {
 	pool_t pool;
+	size_t size;
+	// Consecutive heap_trim() passes that found the arena completely free.
+	int idle_trims;
 	struct arena_t* next;
 } arena_t;
 
-// Stores backtrace, address of memory, size of individual memory, ptr to next storage
-/*typedef struct storage_t
+// Start of the pages of a large allocation, linked so heap_destroy can unmap leaks.
+typedef struct heap_large_t
+{
+	// Committed bytes, and the reserved address range they can grow into in place.
+	size_t size;
+	size_t reserve_size;
+	struct heap_large_t* prev;
+	struct heap_large_t* next;
+} heap_large_t;
+
+// Stored immediately in front of every allocation.
+typedef struct heap_header_t
+{
+	// Size requested by the caller.
+	size_t size;
+	// Bytes from the start of the TLSF block to the allocation; grows with alignment.
+	uint32_t offset;
+	uint8_t tag;
+	uint8_t flags;
+} heap_header_t;
+
+// A free block sitting in a cache.
+typedef struct heap_cache_block_t
+{
+	struct heap_cache_block_t* next;
+} heap_cache_block_t;
+
+// Per-fiber cache of free blocks, one list per size class. A thread that never
+// converts to a fiber has a single cache, so this is per thread for most threads.
+// Only the owning fiber touches the lists; the heap lock guards the links.
+typedef struct heap_cache_t
+{
+	heap_t* heap;
+	heap_cache_block_t* blocks[k_heap_cache_class_count];
+	int counts[k_heap_cache_class_count];
+	heap_cache_stats_t stats;
+	// Bytes left to allocate before the next sample, and random state to jitter the interval.
+	int64_t bytes_until_sample;
+	uint32_t sample_seed;
+	// Usage not yet folded into the heap totals.
+	int64_t tag_live_bytes[k_heap_tag_count];
+	int64_t tag_live_count[k_heap_tag_count];
+	struct heap_cache_t* prev;
+	struct heap_cache_t* next;
+} heap_cache_t;
+
+// Callstack and size of a sampled allocation, keyed by address in the sample table.
+typedef struct heap_sample_t
 {
-	void** backtrace;
 	void* address;
 	size_t size;
-	struct storage_t* s_next;
-} storage_t;
-*/
+	heap_tag_t tag;
+	int frame_count;
+	void* frames[k_heap_sample_depth];
+} heap_sample_t;
+
+// Sampled allocations that share a callstack.
+typedef struct heap_site_t
+{
+	heap_sample_t* sample;
+	size_t estimated_bytes;
+	int sample_count;
+} heap_site_t;
 
 typedef struct heap_t
 {
 	tlsf_t tlsf;
 	size_t grow_increment;
 	arena_t* arena;
-	/* struct storage_t* s_next; */ // ptr to first memory alloc data
 	mutex_t* mutex;
+
+	// Child heaps take their arenas from a parent instead of the OS,
+	// and may not hold more than budget bytes of it.
+	heap_t* parent;
+	heap_tag_t parent_tag;
+	size_t budget;
+	heap_overflow_func_t overflow;
+	void* overflow_user;
+
+	// Child heaps, trimmed along with their parent.
+	// Has its own lock since children take the parent lock while holding theirs.
+	mutex_t* children_mutex;
+	heap_t* children;
+	heap_t* next_sibling;
+
+	// Optional contiguous range reserved up front; its pool grows in place as pages are committed.
+	// Also on the arena list, so it is walked and released like any other arena.
+	arena_t* reserve;
+	size_t reserve_size;
+	bool reserve_large_pages;
+	size_t page_size;
+
+	// Large allocations mapped outside TLSF.
+	heap_large_t* large;
+	size_t large_bytes;
+	size_t large_count;
+
+	DWORD cache_index;
+	heap_cache_t* caches;
+	// Number of caches on the list, read without the lock to size each cache's share.
+	volatile LONG cache_count;
+	heap_cache_stats_t retired_cache_stats;
+
+	// Blocks freed while another thread held the lock, pushed without locking.
+	// Returned to TLSF in one batch by the next thread to take the lock.
+	heap_cache_block_t* deferred;
+
+	size_t reserved_bytes;
+	int64_t live_bytes;
+	int64_t peak_live_bytes;
+	int64_t tag_live_bytes[k_heap_tag_count];
+	int64_t tag_live_count[k_heap_tag_count];
+
+	// Open addressing hash table of sampled allocations, guarded by its own lock.
+	// Lives outside TLSF so sampling never recurses into the heap.
+	size_t sample_rate;
+	mutex_t* sample_mutex;
+	heap_sample_t* samples;
+	int sample_count;
+	uint64_t dropped_samples;
 } heap_t;
 
+static const char* const k_heap_tag_names[k_heap_tag_count] =
+{
+	"general",
+	"ecs",
+	"render",
+	"fs",
+	"net",
+	"trace",
+};
+
+static void* heap_block_alloc_locked(heap_t* heap, size_t size, size_t alignment);
+static void heap_init(heap_t* heap, size_t grow_increment);
+static void* heap_pages_alloc(heap_t* heap, size_t size, size_t alignment);
+static void heap_pages_free(heap_t* heap, void* address);
+static bool heap_budget_check_locked(heap_t* heap, size_t size);
+static bool heap_reserve_grow_locked(heap_t* heap, size_t size);
+static size_t heap_reserve_shrink_locked(heap_t* heap);
+static void* heap_large_alloc(heap_t* heap, size_t size, size_t alignment, heap_tag_t tag);
+static void heap_large_free(heap_t* heap, void* address);
+static bool heap_large_resize(heap_t* heap, void* address, size_t size);
+static void* heap_realloc_copy(heap_t* heap, void* address, size_t size, size_t alignment);
+static void* heap_header_write(void* block, size_t offset, size_t size, heap_tag_t tag);
+static void heap_account_locked(heap_t* heap, heap_tag_t tag, int64_t bytes, int64_t count);
+static heap_cache_t* heap_cache_get(heap_t* heap);
+static int heap_cache_class_capacity(heap_t* heap, int size_class);
+static void heap_cache_fold_locked(heap_t* heap, heap_cache_t* cache);
+static void heap_cache_release(heap_cache_t* cache);
+static void heap_defer_free(heap_t* heap, heap_cache_block_t* first, heap_cache_block_t* last);
+static void heap_deferred_drain_locked(heap_t* heap);
+static void heap_stats_walker(void* ptr, size_t size, int used, void* user);
+static void heap_trim_walker(void* ptr, size_t size, int used, void* user);
+static void heap_sample_add(heap_t* heap, heap_cache_t* cache, void* address);
+static void heap_sample_remove(heap_t* heap, void* address);
+static void heap_sample_print_sites(heap_t* heap, const char* title);
+static void WINAPI heap_cache_thread_exit(void* data);
 
 heap_t* heap_create(size_t grow_increment)
 {
@@ -48,128 +236,1288 @@ heap_t* heap_create(size_t grow_increment)
 		return NULL;
 	}
 
-	heap->mutex = mutex_create();
-	heap->grow_increment = grow_increment;
-	heap->tlsf = tlsf_create(heap + 1);
-	heap->arena = NULL;
+	heap_init(heap, grow_increment);
 
 	return heap;
 }
 
-void* heap_alloc(heap_t* heap, size_t size, size_t alignment)
+heap_t* heap_create_child(heap_t* parent, size_t budget, heap_tag_t tag, heap_overflow_func_t overflow, void* user)
+{
+	heap_t* heap = heap_alloc_tagged(parent, sizeof(heap_t) + tlsf_size(), 16, tag);
+	if (!heap)
+	{
+		return NULL;
+	}
+
+	// Grow in steps small enough that the last arena doesn't strand much of the budget.
+	heap_init(heap, __min(parent->grow_increment, budget / 4));
+	heap->parent = parent;
+	heap->parent_tag = tag;
+	heap->budget = budget;
+	heap->overflow = overflow;
+	heap->overflow_user = user;
+
+	mutex_lock(parent->children_mutex);
+	heap->next_sibling = parent->children;
+	parent->children = heap;
+	mutex_unlock(parent->children_mutex);
+
+	return heap;
+}
+
+void heap_set_budget(heap_t* heap, size_t budget)
 {
 	mutex_lock(heap->mutex);
+	heap->budget = budget;
+	mutex_unlock(heap->mutex);
+}
 
-	void* address = tlsf_memalign(heap->tlsf, alignment, size);
-	if (!address)
+heap_t* heap_create_reserved(size_t reserve_size, size_t grow_increment, uint32_t flags)
+{
+	heap_t* heap = heap_create(grow_increment);
+	if (!heap)
 	{
-		size_t arena_size =
-			__max(heap->grow_increment, size * 2) +
-			sizeof(arena_t);
-		arena_t* arena = VirtualAlloc(NULL,
-			arena_size + tlsf_pool_overhead(),
-			MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+		return NULL;
+	}
+
+	reserve_size = __min(reserve_size, tlsf_block_size_max());
+
+	arena_t* arena = NULL;
+	size_t commit_size = 0;
+	if (flags & k_heap_reserve_large_pages)
+	{
+		// Large pages cannot be committed lazily, so the whole range is committed now.
+		// Needs the SeLockMemoryPrivilege; without it fall back to normal pages.
+		size_t large_page_size = GetLargePageMinimum();
+		if (large_page_size)
+		{
+			reserve_size = (reserve_size + large_page_size - 1) & ~(large_page_size - 1);
+			arena = VirtualAlloc(NULL, reserve_size,
+				MEM_COMMIT | MEM_RESERVE | MEM_LARGE_PAGES, PAGE_READWRITE);
+			commit_size = reserve_size;
+			heap->reserve_large_pages = arena != NULL;
+		}
 		if (!arena)
 		{
-			debug_print(
-				k_print_error,
-				"OUT OF MEMORY!\n");
-			return NULL;
+			debug_print(k_print_warning, "Large pages unavailable, heap uses normal pages.\n");
 		}
+	}
 
-		arena->pool = tlsf_add_pool(heap->tlsf, arena + 1, arena_size);
-
-		arena->next = heap->arena;
-		heap->arena = arena;
+	if (!arena)
+	{
+		reserve_size = (reserve_size + heap->page_size - 1) & ~(heap->page_size - 1);
+		commit_size = __min((grow_increment + heap->page_size - 1) & ~(heap->page_size - 1), reserve_size);
+		arena = VirtualAlloc(NULL, reserve_size, MEM_RESERVE, PAGE_NOACCESS);
+		if (arena && !VirtualAlloc(arena, commit_size, MEM_COMMIT, PAGE_READWRITE))
+		{
+			VirtualFree(arena, 0, MEM_RELEASE);
+			arena = NULL;
+		}
+	}
 
-		address = tlsf_memalign(heap->tlsf, alignment, size);
+	if (!arena)
+	{
+		debug_print(k_print_warning, "Failed to reserve %zu bytes, heap grows by arenas.\n", reserve_size);
+		return heap;
 	}
-	/* if (address) {
-		// Adds data to the struct
-		storage_t* storage = VirtualAlloc(NULL, sizeof(storage_t),
-			MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
-		storage->address = address;
-		// debug_backtrace(storage->backtrace, 8);
-		storage->size = size;
-
-		// Connects the ptr of last added memory data to current memory data
-		if (heap->s_next) {
-			storage_t* cur = heap->s_next;
-			while (cur->s_next) {
-				cur->s_next = cur->s_next;
+
+	arena->pool = tlsf_add_pool(heap->tlsf, arena + 1, commit_size - sizeof(arena_t));
+	arena->size = commit_size;
+	arena->idle_trims = 0;
+	arena->next = heap->arena;
+	heap->arena = arena;
+	heap->reserve = arena;
+	heap->reserve_size = reserve_size;
+	heap->reserved_bytes += commit_size;
+
+	return heap;
+}
+
+void* heap_alloc(heap_t* heap, size_t size, size_t alignment)
+{
+	return heap_alloc_tagged(heap, size, alignment, k_heap_tag_general);
+}
+
+void* heap_alloc_tagged(heap_t* heap, size_t size, size_t alignment, heap_tag_t tag)
+{
+	heap_cache_t* cache = heap_cache_get(heap);
+	void* address = NULL;
+
+	size_t block_size = size + sizeof(heap_header_t);
+	if (cache && block_size <= k_heap_cache_max_size && alignment <= tlsf_align_size())
+	{
+		int size_class = 0;
+		while (((size_t)1 << (size_class + k_heap_cache_min_shift)) < block_size)
+		{
+			++size_class;
+		}
+
+		void* block = cache->blocks[size_class];
+		if (block)
+		{
+			cache->blocks[size_class] = cache->blocks[size_class]->next;
+			cache->counts[size_class]--;
+			cache->stats.alloc_hits++;
+		}
+		else
+		{
+			// Cache is empty: refill a batch of blocks under a single lock.
+			size_t class_size = (size_t)1 << (size_class + k_heap_cache_min_shift);
+			cache->stats.alloc_misses++;
+
+			mutex_lock(heap->mutex);
+			block = heap_block_alloc_locked(heap, class_size, alignment);
+			for (int i = 1; block && i < k_heap_cache_batch; ++i)
+			{
+				heap_cache_block_t* extra = tlsf_malloc(heap->tlsf, class_size);
+				if (!extra)
+				{
+					break;
+				}
+				extra->next = cache->blocks[size_class];
+				cache->blocks[size_class] = extra;
+				cache->counts[size_class]++;
 			}
-			cur->s_next = storage;
+			heap_cache_fold_locked(heap, cache);
+			mutex_unlock(heap->mutex);
+		}
+
+		if (block)
+		{
+			cache->tag_live_bytes[tag] += size;
+			cache->tag_live_count[tag]++;
+			address = heap_header_write(block, sizeof(heap_header_t), size, tag);
 		}
-		else {
-			heap->s_next = storage;
+	}
+	else if (size >= k_heap_large_size && alignment <= heap->page_size)
+	{
+		address = heap_large_alloc(heap, size, alignment, tag);
+	}
+	else
+	{
+		// Over-aligned allocations pad the front of the block so the header still fits.
+		size_t offset = alignment <= tlsf_align_size() ? sizeof(heap_header_t) : __max(alignment, sizeof(heap_header_t));
+
+		mutex_lock(heap->mutex);
+		void* block = heap_block_alloc_locked(heap, size + offset, alignment);
+		if (block)
+		{
+			address = heap_header_write(block, offset, size, tag);
+			heap_account_locked(heap, tag, size, 1);
 		}
-	}*/
-	
+		mutex_unlock(heap->mutex);
+	}
 
-	mutex_unlock(heap->mutex);
+	// Sampling costs a subtract and a branch unless this allocation crosses the sampling interval.
+	if (address && cache && heap->sample_rate)
+	{
+		cache->bytes_until_sample -= (int64_t)size;
+		if (cache->bytes_until_sample <= 0)
+		{
+			heap_sample_add(heap, cache, address);
+		}
+	}
 
 	return address;
 }
 
 void heap_free(heap_t* heap, void* address)
 {
+	if (!address)
+	{
+		return;
+	}
+
+	heap_header_t* header = (heap_header_t*)address - 1;
+	void* block = (char*)address - header->offset;
+	size_t size = header->size;
+	heap_tag_t tag = header->tag;
+
+	if (header->flags & k_heap_flag_sampled)
+	{
+		heap_sample_remove(heap, address);
+	}
+
+	if (header->flags & k_heap_flag_large)
+	{
+		heap_large_free(heap, address);
+		return;
+	}
+
+	size_t block_size = tlsf_block_size(block);
+	if (header->offset == sizeof(heap_header_t) &&
+		block_size >= ((size_t)1 << k_heap_cache_min_shift) && block_size < (k_heap_cache_max_size << 1))
+	{
+		heap_cache_t* cache = heap_cache_get(heap);
+		if (cache)
+		{
+			cache->tag_live_bytes[tag] -= size;
+			cache->tag_live_count[tag]--;
+
+			// Largest class that fits in the block, so the block can serve any request of that class.
+			int size_class = 0;
+			while (size_class + 1 < k_heap_cache_class_count &&
+				((size_t)1 << (size_class + 1 + k_heap_cache_min_shift)) <= block_size)
+			{
+				++size_class;
+			}
+
+			heap_cache_block_t* cache_block = block;
+			cache_block->next = cache->blocks[size_class];
+			cache->blocks[size_class] = cache_block;
+			cache->counts[size_class]++;
+
+			if (cache->counts[size_class] < heap_cache_class_capacity(heap, size_class))
+			{
+				cache->stats.free_hits++;
+				return;
+			}
+
+			// Cache is full: flush a batch back to TLSF under a single lock.
+			cache->stats.free_misses++;
+
+			heap_cache_block_t* first = cache->blocks[size_class];
+			heap_cache_block_t* last = first;
+			for (int i = 1; i < k_heap_cache_batch; ++i)
+			{
+				last = last->next;
+			}
+			cache->blocks[size_class] = last->next;
+			cache->counts[size_class] -= k_heap_cache_batch;
+			last->next = NULL;
+
+			// Typically a consumer thread freeing what a producer allocated; don't wait on the producer.
+			if (!mutex_try_lock(heap->mutex))
+			{
+				cache->stats.deferred_frees += k_heap_cache_batch;
+				heap_defer_free(heap, first, last);
+				return;
+			}
+			heap_deferred_drain_locked(heap);
+			while (first)
+			{
+				heap_cache_block_t* next = first->next;
+				tlsf_free(heap->tlsf, first);
+				first = next;
+			}
+			heap_cache_fold_locked(heap, cache);
+			mutex_unlock(heap->mutex);
+			return;
+		}
+	}
+
+	// Usage is charged to the cache, so a contended free needs no lock at all.
+	heap_cache_t* cache = heap_cache_get(heap);
+	if (cache && !mutex_try_lock(heap->mutex))
+	{
+		cache->tag_live_bytes[tag] -= size;
+		cache->tag_live_count[tag]--;
+		cache->stats.deferred_frees++;
+		heap_defer_free(heap, block, block);
+		return;
+	}
+	if (!cache)
+	{
+		mutex_lock(heap->mutex);
+	}
+	heap_deferred_drain_locked(heap);
+	tlsf_free(heap->tlsf, block);
+	heap_account_locked(heap, tag, -(int64_t)size, -1);
+	mutex_unlock(heap->mutex);
+}
+
+void* heap_realloc(heap_t* heap, void* address, size_t size, size_t alignment)
+{
+	if (!address)
+	{
+		return heap_alloc(heap, size, alignment);
+	}
+	if (!size)
+	{
+		heap_free(heap, address);
+		return NULL;
+	}
+
+	heap_header_t* header = (heap_header_t*)address - 1;
+	if (header->flags & k_heap_flag_large)
+	{
+		if (size >= k_heap_large_size && heap_large_resize(heap, address, size))
+		{
+			return address;
+		}
+		return heap_realloc_copy(heap, address, size, alignment);
+	}
+
+	// Blocks that will become large, or that were padded for alignment, always move.
+	if (size >= k_heap_large_size || header->offset != sizeof(heap_header_t) || alignment > tlsf_align_size())
+	{
+		return heap_realloc_copy(heap, address, size, alignment);
+	}
+
+	void* block = (char*)address - header->offset;
+	heap_tag_t tag = header->tag;
+	size_t old_size = header->size;
+	bool sampled = (header->flags & k_heap_flag_sampled) != 0;
+
+	// TLSF grows in place when the next physical block is free, otherwise it copies into a new block.
+	mutex_lock(heap->mutex);
+	heap_deferred_drain_locked(heap);
+	void* new_block = tlsf_realloc(heap->tlsf, block, size + sizeof(heap_header_t));
+	if (new_block)
+	{
+		heap_account_locked(heap, tag, (int64_t)size - (int64_t)old_size, 0);
+	}
+	mutex_unlock(heap->mutex);
+
+	if (!new_block)
+	{
+		// TLSF is out of space; heap_alloc grows the heap.
+		return heap_realloc_copy(heap, address, size, alignment);
+	}
+
+	void* new_address = heap_header_write(new_block, sizeof(heap_header_t), size, tag);
+	if (sampled)
+	{
+		if (new_address == address)
+		{
+			((heap_header_t*)new_address - 1)->flags = k_heap_flag_sampled;
+		}
+		else
+		{
+			heap_sample_remove(heap, address);
+		}
+	}
+	return new_address;
+}
+
+void heap_get_stats(heap_t* heap, heap_stats_t* stats)
+{
+	memset(stats, 0, sizeof(*stats));
+
 	mutex_lock(heap->mutex);
-	tlsf_free(heap->tlsf, address);
-	// finds which memory storage matches the address
-	/*storage_t* prev = heap->s_next;
-	storage_t* cur = heap->s_next;
-	while (cur->address != address) {
-		prev = cur;
-		cur = cur->s_next;
+	heap_deferred_drain_locked(heap);
+
+#if defined(_DEBUG)
+	if (tlsf_check(heap->tlsf))
+	{
+		debug_print(k_print_error, "Heap corruption detected!\n");
+	}
+#endif
+
+	// Other threads' caches are read without their cooperation; counters may be a little stale.
+	int64_t tag_live_bytes[k_heap_tag_count];
+	int64_t tag_live_count[k_heap_tag_count];
+	memcpy(tag_live_bytes, heap->tag_live_bytes, sizeof(tag_live_bytes));
+	memcpy(tag_live_count, heap->tag_live_count, sizeof(tag_live_count));
+
+	stats->cache = heap->retired_cache_stats;
+	for (heap_cache_t* cache = heap->caches; cache; cache = cache->next)
+	{
+		stats->cache.alloc_hits += cache->stats.alloc_hits;
+		stats->cache.alloc_misses += cache->stats.alloc_misses;
+		stats->cache.free_hits += cache->stats.free_hits;
+		stats->cache.free_misses += cache->stats.free_misses;
+		stats->cache.deferred_frees += cache->stats.deferred_frees;
+
+		for (int i = 0; i < k_heap_cache_class_count; ++i)
+		{
+			stats->cached_bytes += (size_t)cache->counts[i] << (i + k_heap_cache_min_shift);
+		}
+		for (int i = 0; i < k_heap_tag_count; ++i)
+		{
+			tag_live_bytes[i] += cache->tag_live_bytes[i];
+			tag_live_count[i] += cache->tag_live_count[i];
+		}
+	}
+
+	int64_t live_bytes = 0;
+	for (int i = 0; i < k_heap_tag_count; ++i)
+	{
+		stats->tag_live_bytes[i] = tag_live_bytes[i] > 0 ? (size_t)tag_live_bytes[i] : 0;
+		stats->tag_live_count[i] = tag_live_count[i] > 0 ? (size_t)tag_live_count[i] : 0;
+		live_bytes += tag_live_bytes[i];
+	}
+	heap->peak_live_bytes = __max(heap->peak_live_bytes, live_bytes);
+	stats->live_bytes = live_bytes > 0 ? (size_t)live_bytes : 0;
+	stats->peak_live_bytes = (size_t)heap->peak_live_bytes;
+
+	stats->reserved_bytes = heap->reserved_bytes;
+	stats->large_bytes = heap->large_bytes;
+	stats->large_count = heap->large_count;
+	for (arena_t* arena = heap->arena; arena; arena = arena->next)
+	{
+		tlsf_walk_pool(arena->pool, heap_stats_walker, stats);
 	}
 
-	// fixes ptrs
-	if (cur->s_next == NULL) {
-		if (prev == NULL) {
-			heap->s_next = NULL;
+	mutex_unlock(heap->mutex);
+
+	stats->fragmentation = stats->free_bytes ?
+		1.0f - (float)stats->largest_free_block / (float)stats->free_bytes :
+		0.0f;
+}
+
+void heap_print_stats(heap_t* heap)
+{
+	heap_stats_t stats;
+	heap_get_stats(heap, &stats);
+
+	uint64_t cache_allocs = stats.cache.alloc_hits + stats.cache.alloc_misses;
+	debug_print(k_print_info, "Heap: live=%zuKB peak=%zuKB reserved=%zuKB large=%zuKB (%zu) free=%zuKB cached=%zuKB fragmentation=%.1f%% cache hit=%.1f%% deferred frees=%llu\n",
+		stats.live_bytes / 1024, stats.peak_live_bytes / 1024, stats.reserved_bytes / 1024,
+		stats.large_bytes / 1024, stats.large_count,
+		stats.free_bytes / 1024, stats.cached_bytes / 1024, stats.fragmentation * 100.0f,
+		cache_allocs ? 100.0 * (double)stats.cache.alloc_hits / (double)cache_allocs : 0.0,
+		stats.cache.deferred_frees);
+	for (int i = 0; i < k_heap_tag_count; ++i)
+	{
+		if (stats.tag_live_count[i])
+		{
+			debug_print(k_print_info, "  %s: %zuKB in %zu allocations\n",
+				k_heap_tag_names[i], stats.tag_live_bytes[i] / 1024, stats.tag_live_count[i]);
 		}
-		else {
-			prev->s_next = NULL;
+	}
+}
+
+size_t heap_trim(heap_t* heap)
+{
+	size_t released_bytes = 0;
+
+	// Arenas children release become free blocks here, so trim them first.
+	mutex_lock(heap->children_mutex);
+	for (heap_t* child = heap->children; child; child = child->next_sibling)
+	{
+		released_bytes += heap_trim(child);
+	}
+	mutex_unlock(heap->children_mutex);
+
+	mutex_lock(heap->mutex);
+	heap_deferred_drain_locked(heap);
+
+	// Blocks in the calling fiber's cache would pin their arenas, so hand them back first.
+	// Other caches are only touched by their owners; k_heap_cache_max_bytes bounds what they keep.
+	heap_cache_t* cache = heap->cache_index != FLS_OUT_OF_INDEXES ? FlsGetValue(heap->cache_index) : NULL;
+	if (cache)
+	{
+		for (int i = 0; i < k_heap_cache_class_count; ++i)
+		{
+			while (cache->blocks[i])
+			{
+				heap_cache_block_t* next = cache->blocks[i]->next;
+				tlsf_free(heap->tlsf, cache->blocks[i]);
+				cache->blocks[i] = next;
+			}
+			cache->counts[i] = 0;
 		}
 	}
-	else {
-		if (prev == NULL) {
-			heap->s_next = cur->s_next;
+
+	arena_t** link = &heap->arena;
+	while (*link)
+	{
+		arena_t* arena = *link;
+
+		// The reserved range is never released early, only its free end decommitted.
+		if (arena == heap->reserve)
+		{
+			released_bytes += heap_reserve_shrink_locked(heap);
+			link = &arena->next;
+			continue;
+		}
+
+		bool in_use = false;
+		tlsf_walk_pool(arena->pool, heap_trim_walker, &in_use);
+		if (in_use)
+		{
+			arena->idle_trims = 0;
+			link = &arena->next;
 		}
-		else {
-			prev->s_next = cur->s_next;
+		else if (++arena->idle_trims < k_heap_trim_idle_passes)
+		{
+			link = &arena->next;
+		}
+		else
+		{
+			*link = arena->next;
+			tlsf_remove_pool(heap->tlsf, arena->pool);
+			heap->reserved_bytes -= arena->size;
+			released_bytes += arena->size;
+			heap_pages_free(heap, arena);
 		}
-	} */
+	}
+
 	mutex_unlock(heap->mutex);
+
+	return released_bytes;
+}
+
+void heap_set_sample_rate(heap_t* heap, size_t bytes)
+{
+	heap->sample_rate = heap->samples ? bytes : 0;
+}
+
+void heap_profile_dump(heap_t* heap)
+{
+	heap_sample_print_sites(heap, "Top sampled allocation sites");
 }
 
 void heap_destroy(heap_t* heap)
 {
-	// if there is still unfreed memory
-	/*
-	if (heap->s_next) {
-		storage_t* cur = heap->s_next;
-		while (cur != NULL) {
-			debug_print(
-				k_print_info,
-				"Memory leak of size %zu bytes with callstack:\n",
-				cur->size,
-				cur->backtrace);
-			cur = cur->s_next;
-		}
+	// Any sampled allocation still in the table was never freed.
+	if (heap->sample_count)
+	{
+		heap_sample_print_sites(heap, "Sampled memory leaks");
+	}
+
+	// Caches of threads that are still alive are released with the arenas below.
+	if (heap->cache_index != FLS_OUT_OF_INDEXES)
+	{
+		FlsFree(heap->cache_index);
 	}
-	*/
+
 	tlsf_destroy(heap->tlsf);
 
+	heap_large_t* large = heap->large;
+	while (large)
+	{
+		heap_large_t* next = large->next;
+		heap_pages_free(heap, large);
+		large = next;
+	}
+
 	arena_t* arena = heap->arena;
 	while (arena)
 	{
 		arena_t* next = arena->next;
-		VirtualFree(arena, 0, MEM_RELEASE);
+		heap_pages_free(heap, arena);
 		arena = next;
 	}
 
 	mutex_destroy(heap->mutex);
+	mutex_destroy(heap->sample_mutex);
+	mutex_destroy(heap->children_mutex);
+	if (heap->samples)
+	{
+		VirtualFree(heap->samples, 0, MEM_RELEASE);
+	}
+
+	if (heap->parent)
+	{
+		mutex_lock(heap->parent->children_mutex);
+		heap_t** link = &heap->parent->children;
+		while (*link != heap)
+		{
+			link = &(*link)->next_sibling;
+		}
+		*link = heap->next_sibling;
+		mutex_unlock(heap->parent->children_mutex);
+
+		heap_free(heap->parent, heap);
+	}
+	else
+	{
+		VirtualFree(heap, 0, MEM_RELEASE);
+	}
+}
+
+// Set up a heap in memory large enough for heap_t and the TLSF control structure.
+static void heap_init(heap_t* heap, size_t grow_increment)
+{
+	heap->mutex = mutex_create();
+	mutex_set_name(heap->mutex, "heap");
+	heap->grow_increment = grow_increment;
+	heap->tlsf = tlsf_create(heap + 1);
+	heap->arena = NULL;
+	heap->parent = NULL;
+	heap->parent_tag = k_heap_tag_general;
+	heap->budget = SIZE_MAX;
+	heap->overflow = NULL;
+	heap->overflow_user = NULL;
+	heap->children_mutex = mutex_create();
+	heap->children = NULL;
+	heap->next_sibling = NULL;
+	heap->reserve = NULL;
+	heap->reserve_size = 0;
+	heap->reserve_large_pages = false;
+	heap->large = NULL;
+	heap->large_bytes = 0;
+	heap->large_count = 0;
+
+	SYSTEM_INFO system_info;
+	GetSystemInfo(&system_info);
+	heap->page_size = system_info.dwPageSize;
+
+	// Fiber local storage runs a callback when a fiber is deleted or its thread exits,
+	// which lets it hand its cached blocks back to TLSF.
+	heap->cache_index = FlsAlloc(heap_cache_thread_exit);
+	heap->caches = NULL;
+	heap->cache_count = 0;
+	heap->deferred = NULL;
+	memset(&heap->retired_cache_stats, 0, sizeof(heap->retired_cache_stats));
+
+	heap->reserved_bytes = 0;
+	heap->live_bytes = 0;
+	heap->peak_live_bytes = 0;
+	memset(heap->tag_live_bytes, 0, sizeof(heap->tag_live_bytes));
+	memset(heap->tag_live_count, 0, sizeof(heap->tag_live_count));
+
+	heap->sample_rate = k_heap_default_sample_rate;
+	heap->sample_mutex = mutex_create();
+	mutex_set_name(heap->sample_mutex, "heap samples");
+	heap->samples = VirtualAlloc(NULL, sizeof(heap_sample_t) * k_heap_sample_capacity,
+		MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+	heap->sample_count = 0;
+	heap->dropped_samples = 0;
+
+}
+
+// Get memory for an arena or large allocation.
+// Child heaps take it from their parent, others from the OS.
+static void* heap_pages_alloc(heap_t* heap, size_t size, size_t alignment)
+{
+	if (heap->parent)
+	{
+		return heap_alloc_tagged(heap->parent, size, alignment, heap->parent_tag);
+	}
+	return VirtualAlloc(NULL, size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+}
+
+// Release memory from heap_pages_alloc().
+static void heap_pages_free(heap_t* heap, void* address)
+{
+	if (heap->parent)
+	{
+		heap_free(heap->parent, address);
+	}
+	else
+	{
+		VirtualFree(address, 0, MEM_RELEASE);
+	}
+}
+
+// Check that the heap may map size more bytes without exceeding its budget.
+// Gives the overflow callback one chance to make room.
+// Caller must hold the heap lock; the callback runs with it held.
+static bool heap_budget_check_locked(heap_t* heap, size_t size)
+{
+	if (heap->reserved_bytes + size <= heap->budget)
+	{
+		return true;
+	}
+	if (heap->overflow && heap->overflow(heap, size, heap->overflow_user) &&
+		heap->reserved_bytes + size <= heap->budget)
+	{
+		return true;
+	}
+
+	debug_print(k_print_warning, "Heap budget of %zuKB exceeded by a request for %zu bytes.\n",
+		heap->budget / 1024, size);
+	return false;
+}
+
+// Allocate a raw block from TLSF, growing the heap by a new arena if needed.
+// Caller must hold the heap lock.
+static void* heap_block_alloc_locked(heap_t* heap, size_t size, size_t alignment)
+{
+	heap_deferred_drain_locked(heap);
+
+	void* address = tlsf_memalign(heap->tlsf, alignment, size);
+	if (!address && heap_reserve_grow_locked(heap, size + alignment))
+	{
+		address = tlsf_memalign(heap->tlsf, alignment, size);
+	}
+	if (!address)
+	{
+		size_t arena_size =
+			__max(heap->grow_increment, size * 2) +
+			sizeof(arena_t) + tlsf_pool_overhead();
+
+		size_t min_arena_size = size + alignment + sizeof(arena_t) + tlsf_pool_overhead();
+		if (heap->reserved_bytes + min_arena_size > heap->budget)
+		{
+			// The callback may free blocks or raise the budget, so look for room again after it.
+			if (!heap->overflow || !heap->overflow(heap, size, heap->overflow_user))
+			{
+				debug_print(k_print_warning, "Heap budget of %zuKB exceeded by a request for %zu bytes.\n",
+					heap->budget / 1024, size);
+				return NULL;
+			}
+			heap_deferred_drain_locked(heap);
+			address = tlsf_memalign(heap->tlsf, alignment, size);
+			if (address)
+			{
+				return address;
+			}
+			if (heap->reserved_bytes + min_arena_size > heap->budget)
+			{
+				debug_print(k_print_warning, "Heap budget of %zuKB exceeded by a request for %zu bytes.\n",
+					heap->budget / 1024, size);
+				return NULL;
+			}
+		}
+
+		// Near the budget, settle for a smaller arena.
+		arena_size = __min(arena_size, heap->budget - heap->reserved_bytes);
+
+		arena_t* arena = heap_pages_alloc(heap, arena_size, 16);
+		if (!arena)
+		{
+			debug_print(
+				k_print_error,
+				"OUT OF MEMORY!\n");
+			return NULL;
+		}
+
+		arena->pool = tlsf_add_pool(heap->tlsf, arena + 1, arena_size - sizeof(arena_t));
+		arena->size = arena_size;
+		arena->idle_trims = 0;
+
+		arena->next = heap->arena;
+		heap->arena = arena;
+		heap->reserved_bytes += arena->size;
+
+		address = tlsf_memalign(heap->tlsf, alignment, size);
+	}
+	return address;
+}
+
+// Commit more of the reserved range, at least enough for an allocation of size bytes.
+// Returns false if there is no reservation or it is used up.
+// Caller must hold the heap lock.
+static bool heap_reserve_grow_locked(heap_t* heap, size_t size)
+{
+	arena_t* arena = heap->reserve;
+	if (!arena || arena->size >= heap->reserve_size)
+	{
+		return false;
+	}
+
+	// The free block at the end of the pool merges with the new pages, so this may over-commit slightly.
+	size_t grow_size = __max(heap->grow_increment, size * 2 + tlsf_pool_overhead());
+	grow_size = (grow_size + heap->page_size - 1) & ~(heap->page_size - 1);
+	grow_size = __min(grow_size, heap->reserve_size - arena->size);
+
+	if (!VirtualAlloc((char*)arena + arena->size, grow_size, MEM_COMMIT, PAGE_READWRITE))
+	{
+		debug_print(
+			k_print_error,
+			"OUT OF MEMORY!\n");
+		return false;
+	}
+
+	if (!tlsf_extend_pool(heap->tlsf, arena->pool,
+		arena->size - sizeof(arena_t), arena->size + grow_size - sizeof(arena_t)))
+	{
+		return false;
+	}
+
+	arena->size += grow_size;
+	heap->reserved_bytes += grow_size;
+	return true;
+}
+
+// Decommit free pages at the end of the reserved range, keeping one grow increment
+// of them so an allocation right after a trim doesn't have to commit again.
+// Returns the number of bytes decommitted. Caller must hold the heap lock.
+static size_t heap_reserve_shrink_locked(heap_t* heap)
+{
+	arena_t* arena = heap->reserve;
+	if (!arena || heap->reserve_large_pages)
+	{
+		return 0;
+	}
+
+	size_t free_tail = tlsf_pool_free_tail(arena->pool, arena->size - sizeof(arena_t));
+	if (free_tail <= heap->grow_increment)
+	{
+		return 0;
+	}
+	size_t shrink_size = (free_tail - heap->grow_increment) & ~(heap->page_size - 1);
+	if (shrink_size == 0 ||
+		!tlsf_shrink_pool(heap->tlsf, arena->pool, arena->size - sizeof(arena_t), arena->size - shrink_size - sizeof(arena_t)))
+	{
+		return 0;
+	}
+
+	VirtualFree((char*)arena + arena->size - shrink_size, shrink_size, MEM_DECOMMIT);
+	arena->size -= shrink_size;
+	heap->reserved_bytes -= shrink_size;
+	return shrink_size;
+}
+
+// Map pages for a single allocation outside TLSF.
+// Avoids growing the heap by an arena twice the allocation size, and the pages go back to the OS on free.
+static void* heap_large_alloc(heap_t* heap, size_t size, size_t alignment, heap_tag_t tag)
+{
+	// The mapping is aligned to the allocation's alignment, so only the user address needs padding.
+	size_t offset = sizeof(heap_large_t) + sizeof(heap_header_t);
+	offset = (offset + alignment - 1) & ~(alignment - 1);
+	size_t map_size = (offset + size + heap->page_size - 1) & ~(heap->page_size - 1);
+
+	// Reserve spare address space so heap_realloc can usually grow the mapping in place.
+	// Address space is scarce in 32-bit builds, so there only the unavoidable rounding is spare.
+#if defined(_WIN64)
+	size_t reserve_size = map_size * 2;
+#else
+	size_t reserve_size = map_size;
+#endif
+	reserve_size = (reserve_size + k_heap_large_granularity - 1) & ~((size_t)k_heap_large_granularity - 1);
+
+	mutex_lock(heap->mutex);
+	bool within_budget = heap_budget_check_locked(heap, map_size);
+	mutex_unlock(heap->mutex);
+	if (!within_budget)
+	{
+		return NULL;
+	}
+
+	heap_large_t* large;
+	if (heap->parent)
+	{
+		// A parent block can't be grown by committing pages, so there is nothing spare to reserve.
+		reserve_size = map_size;
+		large = heap_pages_alloc(heap, map_size, __max(alignment, 16));
+	}
+	else
+	{
+		large = VirtualAlloc(NULL, reserve_size, MEM_RESERVE, PAGE_NOACCESS);
+		if (large && !VirtualAlloc(large, map_size, MEM_COMMIT, PAGE_READWRITE))
+		{
+			VirtualFree(large, 0, MEM_RELEASE);
+			large = NULL;
+		}
+	}
+	if (!large)
+	{
+		debug_print(
+			k_print_error,
+			"OUT OF MEMORY!\n");
+		return NULL;
+	}
+	large->size = map_size;
+	large->reserve_size = reserve_size;
+	large->prev = NULL;
+
+	void* address = heap_header_write(large, offset, size, tag);
+	((heap_header_t*)address - 1)->flags = k_heap_flag_large;
+
+	mutex_lock(heap->mutex);
+	large->next = heap->large;
+	if (heap->large)
+	{
+		heap->large->prev = large;
+	}
+	heap->large = large;
+	heap->large_bytes += map_size;
+	heap->large_count++;
+	heap->reserved_bytes += map_size;
+	heap_account_locked(heap, tag, size, 1);
+	mutex_unlock(heap->mutex);
+
+	return address;
+}
+
+// Unlink a large allocation and unmap its pages.
+static void heap_large_free(heap_t* heap, void* address)
+{
+	heap_header_t* header = (heap_header_t*)address - 1;
+	heap_large_t* large = (heap_large_t*)((char*)address - header->offset);
+
+	mutex_lock(heap->mutex);
+	if (large->prev)
+	{
+		large->prev->next = large->next;
+	}
+	else
+	{
+		heap->large = large->next;
+	}
+	if (large->next)
+	{
+		large->next->prev = large->prev;
+	}
+	heap->large_bytes -= large->size;
+	heap->large_count--;
+	heap->reserved_bytes -= large->size;
+	heap_account_locked(heap, header->tag, -(int64_t)header->size, -1);
+	mutex_unlock(heap->mutex);
+
+	heap_pages_free(heap, large);
+}
+
+// Resize a large allocation without moving it, committing more of its reservation if needed.
+// Returns false if the reservation is too small.
+static bool heap_large_resize(heap_t* heap, void* address, size_t size)
+{
+	heap_header_t* header = (heap_header_t*)address - 1;
+	heap_large_t* large = (heap_large_t*)((char*)address - header->offset);
+
+	size_t map_size = (header->offset + size + heap->page_size - 1) & ~(heap->page_size - 1);
+	if (map_size > large->reserve_size)
+	{
+		return false;
+	}
+	if (map_size > large->size &&
+		!VirtualAlloc((char*)large + large->size, map_size - large->size, MEM_COMMIT, PAGE_READWRITE))
+	{
+		return false;
+	}
+
+	mutex_lock(heap->mutex);
+	if (map_size > large->size)
+	{
+		heap->large_bytes += map_size - large->size;
+		heap->reserved_bytes += map_size - large->size;
+		large->size = map_size;
+	}
+	heap_account_locked(heap, header->tag, (int64_t)size - (int64_t)header->size, 0);
+	mutex_unlock(heap->mutex);
+
+	header->size = size;
+	return true;
+}
+
+// Move an allocation to a new block: allocate, copy, free.
+static void* heap_realloc_copy(heap_t* heap, void* address, size_t size, size_t alignment)
+{
+	heap_header_t* header = (heap_header_t*)address - 1;
+	void* new_address = heap_alloc_tagged(heap, size, alignment, header->tag);
+	if (new_address)
+	{
+		memcpy(new_address, address, __min(size, header->size));
+		heap_free(heap, address);
+	}
+	return new_address;
+}
+
+// Fill in the header of a new allocation and return the address handed to the caller.
+static void* heap_header_write(void* block, size_t offset, size_t size, heap_tag_t tag)
+{
+	char* address = (char*)block + offset;
+	heap_header_t* header = (heap_header_t*)address - 1;
+	header->size = size;
+	header->offset = (uint32_t)offset;
+	header->tag = (uint8_t)tag;
+	header->flags = 0;
+	return address;
+}
+
+// Charge bytes and allocation count to a tag and track the high-water mark.
+// Caller must hold the heap lock.
+static void heap_account_locked(heap_t* heap, heap_tag_t tag, int64_t bytes, int64_t count)
+{
+	heap->tag_live_bytes[tag] += bytes;
+	heap->tag_live_count[tag] += count;
+	heap->live_bytes += bytes;
+	heap->peak_live_bytes = __max(heap->peak_live_bytes, heap->live_bytes);
+}
+
+// Get the calling fiber's cache for a heap, creating it on first use.
+// Returns NULL if caches are unavailable.
+static heap_cache_t* heap_cache_get(heap_t* heap)
+{
+	if (heap->cache_index == FLS_OUT_OF_INDEXES)
+	{
+		return NULL;
+	}
+
+	heap_cache_t* cache = FlsGetValue(heap->cache_index);
+	if (!cache)
+	{
+		mutex_lock(heap->mutex);
+		cache = heap_block_alloc_locked(heap, sizeof(heap_cache_t), 8);
+		if (cache)
+		{
+			memset(cache, 0, sizeof(*cache));
+			cache->heap = heap;
+			cache->sample_seed = GetCurrentThreadId() | 1;
+			cache->bytes_until_sample = heap->sample_rate;
+			cache->next = heap->caches;
+			if (heap->caches)
+			{
+				heap->caches->prev = cache;
+			}
+			heap->caches = cache;
+			heap->cache_count++;
+		}
+		mutex_unlock(heap->mutex);
+
+		if (cache)
+		{
+			FlsSetValue(heap->cache_index, cache);
+		}
+	}
+	return cache;
+}
+
+// Number of blocks of a size class a cache may hold before flushing a batch.
+// Shrinks as caches are added so all of them together stay near k_heap_cache_max_bytes.
+static int heap_cache_class_capacity(heap_t* heap, int size_class)
+{
+	size_t class_bytes = k_heap_cache_max_bytes / __max(heap->cache_count, 1) / k_heap_cache_class_count;
+	int capacity = (int)(class_bytes >> (size_class + k_heap_cache_min_shift));
+	return __min(__max(capacity, k_heap_cache_batch), k_heap_cache_capacity);
+}
+
+// Move a cache's pending usage counters into the heap totals.
+// Caller must hold the heap lock.
+static void heap_cache_fold_locked(heap_t* heap, heap_cache_t* cache)
+{
+	for (int i = 0; i < k_heap_tag_count; ++i)
+	{
+		if (cache->tag_live_bytes[i] || cache->tag_live_count[i])
+		{
+			heap_account_locked(heap, i, cache->tag_live_bytes[i], cache->tag_live_count[i]);
+			cache->tag_live_bytes[i] = 0;
+			cache->tag_live_count[i] = 0;
+		}
+	}
+}
+
+// Flag a pool that contains any used block.
+static void heap_trim_walker(void* ptr, size_t size, int used, void* user)
+{
+	if (used)
+	{
+		*(bool*)user = true;
+	}
+}
+
+// Push a chain of blocks onto the deferred free list without taking the heap lock.
+// Drained in one exchange, so the list never pops single nodes and is free of ABA.
+static void heap_defer_free(heap_t* heap, heap_cache_block_t* first, heap_cache_block_t* last)
+{
+	heap_cache_block_t* head;
+	do
+	{
+		head = atomic_load_pointer_explicit((void**)&heap->deferred, k_atomic_relaxed);
+		last->next = head;
+	} while (atomic_compare_and_exchange_pointer_explicit((void**)&heap->deferred, head, first, k_atomic_release) != head);
+}
+
+// Return all deferred blocks to TLSF.
+// Caller must hold the heap lock.
+static void heap_deferred_drain_locked(heap_t* heap)
+{
+	if (!atomic_load_pointer_explicit((void**)&heap->deferred, k_atomic_relaxed))
+	{
+		return;
+	}
+
+	heap_cache_block_t* block = atomic_exchange_pointer_explicit((void**)&heap->deferred, NULL, k_atomic_acquire);
+	while (block)
+	{
+		heap_cache_block_t* next = block->next;
+		tlsf_free(heap->tlsf, block);
+		block = next;
+	}
+}
+
+// Return all of a cache's blocks to TLSF and unlink it from its heap.
+static void heap_cache_release(heap_cache_t* cache)
+{
+	heap_t* heap = cache->heap;
+
+	mutex_lock(heap->mutex);
+
+	for (int i = 0; i < k_heap_cache_class_count; ++i)
+	{
+		heap_cache_block_t* block = cache->blocks[i];
+		while (block)
+		{
+			heap_cache_block_t* next = block->next;
+			tlsf_free(heap->tlsf, block);
+			block = next;
+		}
+	}
+
+	heap->retired_cache_stats.alloc_hits += cache->stats.alloc_hits;
+	heap->retired_cache_stats.alloc_misses += cache->stats.alloc_misses;
+	heap->retired_cache_stats.free_hits += cache->stats.free_hits;
+	heap->retired_cache_stats.free_misses += cache->stats.free_misses;
+	heap->retired_cache_stats.deferred_frees += cache->stats.deferred_frees;
+	heap_cache_fold_locked(heap, cache);
+
+	if (cache->prev)
+	{
+		cache->prev->next = cache->next;
+	}
+	else
+	{
+		heap->caches = cache->next;
+	}
+	if (cache->next)
+	{
+		cache->next->prev = cache->prev;
+	}
+	heap->cache_count--;
+	tlsf_free(heap->tlsf, cache);
+
+	mutex_unlock(heap->mutex);
+}
+
+static void WINAPI heap_cache_thread_exit(void* data)
+{
+	if (data)
+	{
+		heap_cache_release(data);
+	}
+}
+
+static void heap_stats_walker(void* ptr, size_t size, int used, void* user)
+{
+	heap_stats_t* stats = user;
+	if (!used)
+	{
+		stats->free_bytes += size;
+		stats->largest_free_block = __max(stats->largest_free_block, size);
+	}
+}
+
+// Hash an address into the sample table.
+static int heap_sample_slot(void* address)
+{
+	uint64_t key = (uint64_t)(uintptr_t)address >> 3;
+	return (int)((key * 0x9E3779B97F4A7C15ull) >> 32) & (k_heap_sample_capacity - 1);
+}
+
+// Record a callstack for an allocation and schedule the next sample.
+static void heap_sample_add(heap_t* heap, heap_cache_t* cache, void* address)
+{
+	// Jitter the interval so allocation patterns that repeat every N bytes are not always (or never) sampled.
+	cache->sample_seed ^= cache->sample_seed << 13;
+	cache->sample_seed ^= cache->sample_seed >> 17;
+	cache->sample_seed ^= cache->sample_seed << 5;
+	cache->bytes_until_sample = heap->sample_rate / 2 + cache->sample_seed % (heap->sample_rate + 1);
+
+	heap_header_t* header = (heap_header_t*)address - 1;
+
+	heap_sample_t sample;
+	sample.address = address;
+	sample.size = header->size;
+	sample.tag = header->tag;
+	sample.frame_count = debug_backtrace(sample.frames, k_heap_sample_depth);
+
+	mutex_lock(heap->sample_mutex);
+	if (heap->sample_count < k_heap_sample_capacity - 1)
+	{
+		int slot = heap_sample_slot(address);
+		while (heap->samples[slot].address)
+		{
+			slot = (slot + 1) & (k_heap_sample_capacity - 1);
+		}
+		heap->samples[slot] = sample;
+		heap->sample_count++;
+		header->flags |= k_heap_flag_sampled;
+	}
+	else
+	{
+		heap->dropped_samples++;
+	}
+	mutex_unlock(heap->sample_mutex);
+}
+
+// Remove a freed allocation from the sample table.
+static void heap_sample_remove(heap_t* heap, void* address)
+{
+	mutex_lock(heap->sample_mutex);
+
+	int slot = heap_sample_slot(address);
+	while (heap->samples[slot].address && heap->samples[slot].address != address)
+	{
+		slot = (slot + 1) & (k_heap_sample_capacity - 1);
+	}
+
+	if (heap->samples[slot].address)
+	{
+		heap->samples[slot].address = NULL;
+		heap->sample_count--;
+
+		// Shift later entries of the probe run back so lookups never stop at the hole early.
+		int hole = slot;
+		for (int next = (slot + 1) & (k_heap_sample_capacity - 1);
+			heap->samples[next].address;
+			next = (next + 1) & (k_heap_sample_capacity - 1))
+		{
+			int home = heap_sample_slot(heap->samples[next].address);
+			int distance_from_home = (next - home) & (k_heap_sample_capacity - 1);
+			int distance_from_hole = (next - hole) & (k_heap_sample_capacity - 1);
+			if (distance_from_home >= distance_from_hole)
+			{
+				heap->samples[hole] = heap->samples[next];
+				heap->samples[next].address = NULL;
+				hole = next;
+			}
+		}
+	}
+
+	mutex_unlock(heap->sample_mutex);
+}
+
+// Log sampled live allocations grouped by callstack, largest first.
+// Each sample stands in for roughly sample_rate bytes of allocation.
+static void heap_sample_print_sites(heap_t* heap, const char* title)
+{
+	heap_site_t sites[k_heap_profile_max_sites];
+	int site_count = 0;
+
+	mutex_lock(heap->sample_mutex);
+
+	for (int i = 0; i < k_heap_sample_capacity; ++i)
+	{
+		heap_sample_t* sample = &heap->samples[i];
+		if (!sample->address)
+		{
+			continue;
+		}
+
+		heap_site_t* site = NULL;
+		for (int s = 0; s < site_count; ++s)
+		{
+			if (sites[s].sample->frame_count == sample->frame_count &&
+				memcmp(sites[s].sample->frames, sample->frames, sizeof(void*) * sample->frame_count) == 0)
+			{
+				site = &sites[s];
+				break;
+			}
+		}
+		if (!site && site_count < _countof(sites))
+		{
+			site = &sites[site_count++];
+			site->sample = sample;
+			site->estimated_bytes = 0;
+			site->sample_count = 0;
+		}
+		if (site)
+		{
+			site->estimated_bytes += __max(sample->size, heap->sample_rate);
+			site->sample_count++;
+		}
+	}
+
+	debug_print(k_print_info, "%s: %d samples, %llu dropped\n",
+		title, heap->sample_count, heap->dropped_samples);
+
+	// Selection sort; site counts are small.
+	for (int i = 0; i < site_count; ++i)
+	{
+		int largest = i;
+		for (int s = i + 1; s < site_count; ++s)
+		{
+			if (sites[s].estimated_bytes > sites[largest].estimated_bytes)
+			{
+				largest = s;
+			}
+		}
+		heap_site_t site = sites[largest];
+		sites[largest] = sites[i];
+		sites[i] = site;
+
+		debug_print(k_print_info, "  ~%zuKB (%s) from %d samples, callstack:\n",
+			site.estimated_bytes / 1024, k_heap_tag_names[site.sample->tag], site.sample_count);
+		for (int f = 0; f < site.sample->frame_count; ++f)
+		{
+			debug_print(k_print_info, "    %p\n", site.sample->frames[f]);
+		}
+	}
 
-	VirtualFree(heap, 0, MEM_RELEASE);
+	mutex_unlock(heap->sample_mutex);
 }
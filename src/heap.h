@@ -1,5 +1,7 @@
 #pragma once
 
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 
 
@@ -11,24 +13,159 @@ extern "C" {
 // 
 // Main object, heap_t, represents a dynamic memory heap.
 // Once created, memory can be allocated and free from the heap.
+//
+// Each thread that touches a heap gets a small cache of recently freed
+// blocks, bucketed by size class. Small allocations and frees are served
+// from the calling thread's cache without taking the heap lock. Caches are
+// kept per fiber, so a thread running fibers has one per fiber; the heap
+// splits a fixed cache budget between all of them.
+//
+// Allocations of 512KB or more are mapped directly from the OS and
+// unmapped on free, rather than growing the heap by an oversized arena.
+//
+// A sampling profiler records callstacks for a random subset of
+// allocations, cheap enough to leave on in shipping builds.
 
 // Handle to a heap.
 typedef struct heap_t heap_t;
 
+// Subsystem an allocation is charged to in heap statistics.
+typedef enum heap_tag_t
+{
+	k_heap_tag_general,
+	k_heap_tag_ecs,
+	k_heap_tag_render,
+	k_heap_tag_fs,
+	k_heap_tag_net,
+	k_heap_tag_trace,
+
+	k_heap_tag_count,
+} heap_tag_t;
+
+// Counters for the per-thread allocation caches of a heap.
+// Hit rate is hits / (hits + misses).
+typedef struct heap_cache_stats_t
+{
+	// Allocations served from a thread cache without taking the heap lock.
+	uint64_t alloc_hits;
+	// Small allocations that had to refill a thread cache under the heap lock.
+	uint64_t alloc_misses;
+	// Frees pushed onto a thread cache without taking the heap lock.
+	uint64_t free_hits;
+	// Frees that overflowed a thread cache and flushed it under the heap lock.
+	uint64_t free_misses;
+	// Blocks freed while the heap lock was busy, queued for the next lock holder.
+	uint64_t deferred_frees;
+} heap_cache_stats_t;
+
+// Snapshot of heap memory usage. See heap_get_stats().
+typedef struct heap_stats_t
+{
+	// Bytes of OS memory held by the heap's arenas and large allocations.
+	size_t reserved_bytes;
+	// Bytes of OS memory mapped for large allocations, and their count.
+	size_t large_bytes;
+	size_t large_count;
+	// Bytes requested by live allocations.
+	size_t live_bytes;
+	// High-water mark of live_bytes.
+	// Thread caches report in batches, so short spikes may be missed by up to a few KB per thread.
+	size_t peak_live_bytes;
+	// Bytes of free blocks in TLSF.
+	size_t free_bytes;
+	// Size of the largest free block in TLSF.
+	size_t largest_free_block;
+	// Bytes of free blocks parked in thread caches.
+	size_t cached_bytes;
+	// Free space that is unusable for a single allocation: 1 - largest_free_block / free_bytes.
+	float fragmentation;
+	// Live bytes and live allocation count per tag.
+	size_t tag_live_bytes[k_heap_tag_count];
+	size_t tag_live_count[k_heap_tag_count];
+	// Thread cache counters.
+	heap_cache_stats_t cache;
+} heap_stats_t;
+
 // Creates a new memory heap.
 // The grow increment is the default size with which the heap grows.
 // Should be a multiple of OS page size.
 heap_t* heap_create(size_t grow_increment);
 
+// Called when a child heap would grow past its budget, with the heap locked.
+// May free memory from the heap or raise its budget with heap_set_budget().
+// Return true to retry the allocation once, false to fail it.
+typedef bool (*heap_overflow_func_t)(heap_t* heap, size_t size, void* user);
+
+// Creates a heap that takes its memory from a parent heap, charged to tag.
+// The child never holds more than budget bytes of the parent; growing past it
+// calls overflow (which may be NULL) and otherwise fails the allocation.
+// Destroying the child returns all its memory to the parent at once, without
+// walking individual allocations. The parent must outlive the child.
+heap_t* heap_create_child(heap_t* parent, size_t budget, heap_tag_t tag, heap_overflow_func_t overflow, void* user);
+
+// Change the budget of a child heap.
+// Memory already held above a lowered budget is kept until freed and trimmed.
+void heap_set_budget(heap_t* heap, size_t budget);
+
+// Flags for heap_create_reserved().
+enum
+{
+	// Back the reserved range with large pages, committed up front.
+	// Falls back to normal pages if the process lacks SeLockMemoryPrivilege.
+	// heap_trim can't decommit large pages, so they stay held until the heap is destroyed.
+	k_heap_reserve_large_pages = 1 << 0,
+};
+
+// Creates a heap that reserves one contiguous range of address space and
+// commits it in grow_increment steps as the heap grows. A single contiguous
+// pool lets neighboring free blocks merge and keeps large arrays on fewer
+// pages. Once the range is exhausted the heap grows like heap_create().
+heap_t* heap_create_reserved(size_t reserve_size, size_t grow_increment, uint32_t flags);
+
 // Destroy a previously created heap.
 void heap_destroy(heap_t* heap);
 
 // Allocate memory from a heap.
+// The allocation is charged to k_heap_tag_general.
 void* heap_alloc(heap_t* heap, size_t size, size_t alignment);
 
+// Allocate memory from a heap, charged to a subsystem tag.
+void* heap_alloc_tagged(heap_t* heap, size_t size, size_t alignment, heap_tag_t tag);
+
+// Resize memory previously allocated from a heap, keeping its tag.
+// Grows in place when the following memory is free, otherwise moves and copies the contents.
+// A NULL address allocates; a zero size frees and returns NULL.
+// Returns NULL and leaves the old allocation untouched on failure.
+void* heap_realloc(heap_t* heap, void* address, size_t size, size_t alignment);
+
 // Free memory previously allocated from a heap.
 void heap_free(heap_t* heap, void* address);
 
+// Gather usage, fragmentation and per-tag statistics for a heap.
+// Walks every TLSF pool, so cost grows with the number of blocks.
+// Debug builds also check TLSF for corruption.
+void heap_get_stats(heap_t* heap, heap_stats_t* stats);
+
+// Log a summary of heap statistics.
+void heap_print_stats(heap_t* heap);
+
+// Return arenas that have been completely free for several calls to the OS.
+// Meant to be called periodically; an arena is only released after staying
+// free across multiple calls, so short gaps between allocation spikes do
+// not remap memory. Blocks cached by other threads keep their arenas alive.
+// The free end of a reserved range is decommitted, and child heaps are trimmed too.
+// Returns the number of bytes released.
+size_t heap_trim(heap_t* heap);
+
+// Set the average number of bytes allocated between sampled allocations.
+// A sampled allocation records its callstack until it is freed.
+// Sampled allocations still live at heap_destroy() are reported as leaks.
+// Zero disables sampling. Defaults to 512KB.
+void heap_set_sample_rate(heap_t* heap, size_t bytes);
+
+// Log the callstacks holding the most sampled live memory.
+void heap_profile_dump(heap_t* heap);
+
 #ifdef __cplusplus
 }
 #endif
\ No newline at end of file
@@ -0,0 +1,777 @@
+#include "job.h"
+
+#include "atomic.h"
+#include "heap.h"
+#include "object_pool.h"
+#include "queue.h"
+#include "thread.h"
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+#include <stdio.h>
+#include <string.h>
+
+#pragma comment(lib, "Synchronization.lib")
+
+enum
+{
+	k_job_cache_line = 64,
+
+	// Jobs each worker's deque holds. A worker that fills it runs new jobs inline.
+	k_job_deque_capacity = 4096,
+	// Jobs from non-worker threads waiting to be picked up.
+	k_job_injection_capacity = 4096,
+	// Preallocated job records; more come from the heap if they run out.
+	k_job_pool_count = 8192,
+
+	// Fibers jobs run on. When all are busy, jobs run directly on the thread
+	// and a job_wait inside them blocks the thread instead of switching away.
+	k_job_fiber_count = 128,
+	k_job_fiber_stack_size = 64 * 1024,
+
+	// Failed searches for work before a thread sleeps.
+	k_job_spin_count = 64,
+};
+
+typedef struct job_fiber_t job_fiber_t;
+typedef struct job_context_t job_context_t;
+
+// A job to start, or a suspended fiber to resume.
+typedef struct job_t
+{
+	job_func_t func;
+	void* data;
+	job_counter_t* counter;
+	// If not NULL, the job is a continuation: resume this fiber instead of calling func.
+	job_fiber_t* fiber;
+	// Next job held back by the same dependency.
+	struct job_t* next;
+} job_t;
+
+// A fiber with its own stack, reused for one job after another.
+typedef struct job_fiber_t
+{
+	void* fiber;
+	job_system_t* jobs;
+	// Job being run.
+	job_t* job;
+	// Thread the fiber is running on. Changes when a suspended fiber is resumed elsewhere.
+	job_context_t* context;
+} job_fiber_t;
+
+// What a fiber asked its thread to do when it switched back.
+// Done on the thread's own fiber, so no other thread can resume the
+// suspended fiber before it has finished switching out.
+typedef enum job_action_t
+{
+	k_job_action_none,
+	// The job finished; the fiber is free.
+	k_job_action_release,
+	// Resume the fiber once wait_counter reaches zero.
+	k_job_action_wait,
+	// Resume the fiber after other queued work.
+	k_job_action_yield,
+} job_action_t;
+
+// Per-thread scheduling state, found through TLS.
+typedef struct job_context_t
+{
+	// NULL for non-worker threads helping out in job_wait.
+	struct job_worker_t* worker;
+	// The thread's own fiber; jobs switch back to it when they finish or wait.
+	void* thread_fiber;
+	// Fiber running on this thread, or NULL while on the thread's own fiber.
+	job_fiber_t* current;
+	job_action_t action;
+	job_counter_t* wait_counter;
+} job_context_t;
+
+typedef struct job_counter_t
+{
+	// Submitted jobs that haven't finished.
+	int value;
+	// Threads sleeping in job_wait on this counter.
+	int waiters;
+	// Spin lock making "reached zero" and "hold back a dependent" mutually exclusive.
+	int lock;
+	// Jobs to submit when value reaches zero.
+	job_t* dependents;
+} job_counter_t;
+
+// A worker thread and its Chase-Lev deque.
+// The owner pushes and pops at bottom; thieves take from top.
+typedef struct job_worker_t
+{
+	int64_t top;
+	char pad0[k_job_cache_line - sizeof(int64_t)];
+
+	int64_t bottom;
+	char pad1[k_job_cache_line - sizeof(int64_t)];
+
+	job_t* deque[k_job_deque_capacity];
+
+	job_system_t* jobs;
+	thread_t* thread;
+	int index;
+	job_context_t context;
+} job_worker_t;
+
+typedef struct job_system_t
+{
+	heap_t* heap;
+	object_pool_t* job_pool;
+	queue_t* injection;
+
+	job_worker_t** workers;
+	int worker_count;
+
+	job_fiber_t* fibers;
+	// Idle fibers.
+	queue_t* free_fibers;
+
+	// TLS slot holding the calling thread's job_context_t; NULL on other threads.
+	DWORD context_tls;
+	// Context of the thread that created the job system, which helps out in job_wait.
+	// It is made a fiber for the job system's lifetime rather than on every wait.
+	job_context_t creator_context;
+	bool creator_converted;
+	char pad0[k_job_cache_line];
+
+	// Idle workers wait for work_epoch to change; submitters only bump it when someone sleeps.
+	int work_epoch;
+	int sleepers;
+	int shutdown;
+	char pad1[k_job_cache_line - 3 * sizeof(int)];
+} job_system_t;
+
+static int job_worker_thread_func(void* user);
+static void WINAPI job_fiber_func(void* user);
+
+// Push a job on the owner's end. Returns false if the deque is full.
+static bool job_deque_push(job_worker_t* worker, job_t* job)
+{
+	int64_t bottom = worker->bottom;
+	int64_t top = atomic_load64_explicit(&worker->top, k_atomic_acquire);
+	if (bottom - top >= k_job_deque_capacity)
+	{
+		return false;
+	}
+	atomic_store_pointer_explicit((void**)&worker->deque[bottom & (k_job_deque_capacity - 1)], job, k_atomic_relaxed);
+	atomic_store64_explicit(&worker->bottom, bottom + 1, k_atomic_release);
+	return true;
+}
+
+// Pop the newest job from the owner's end.
+static job_t* job_deque_pop(job_worker_t* worker)
+{
+	// Claim the bottom slot before looking at top, so a thief either sees the
+	// claim or we see its steal.
+	int64_t bottom = worker->bottom - 1;
+	atomic_store64_explicit(&worker->bottom, bottom, k_atomic_seq_cst);
+	int64_t top = atomic_load64_explicit(&worker->top, k_atomic_acquire);
+
+	job_t* job = NULL;
+	if (top <= bottom)
+	{
+		job = atomic_load_pointer_explicit((void**)&worker->deque[bottom & (k_job_deque_capacity - 1)], k_atomic_relaxed);
+		if (top == bottom)
+		{
+			// Last job: thieves may be going for it too.
+			if (atomic_compare_and_exchange64(&worker->top, top, top + 1) != top)
+			{
+				job = NULL;
+			}
+			atomic_store64_explicit(&worker->bottom, bottom + 1, k_atomic_relaxed);
+		}
+	}
+	else
+	{
+		atomic_store64_explicit(&worker->bottom, bottom + 1, k_atomic_relaxed);
+	}
+	return job;
+}
+
+// Take the oldest job from another worker's deque.
+// Returns NULL if the deque is empty or another thread won the race for the job.
+static job_t* job_deque_steal(job_worker_t* worker)
+{
+	int64_t top = atomic_load64_explicit(&worker->top, k_atomic_acquire);
+	atomic_fence(k_atomic_seq_cst);
+	int64_t bottom = atomic_load64_explicit(&worker->bottom, k_atomic_acquire);
+	if (top >= bottom)
+	{
+		return NULL;
+	}
+
+	job_t* job = atomic_load_pointer_explicit((void**)&worker->deque[top & (k_job_deque_capacity - 1)], k_atomic_relaxed);
+	if (atomic_compare_and_exchange64(&worker->top, top, top + 1) != top)
+	{
+		return NULL;
+	}
+	return job;
+}
+
+// Fill in an affinity mask for each worker.
+// Each worker gets the whole physical core of one logical processor, so the scheduler
+// can still move it between SMT siblings. The first core is left free for the calling thread.
+// Workers without a processor, and processors outside the calling thread's
+// processor group, are left unpinned.
+static void job_system_affinity_masks(heap_t* heap, uint64_t* masks, int worker_count)
+{
+	memset(masks, 0, sizeof(uint64_t) * worker_count);
+
+	DWORD length = 0;
+	GetLogicalProcessorInformation(NULL, &length);
+	SYSTEM_LOGICAL_PROCESSOR_INFORMATION* info = length ? heap_alloc(heap, length, 8) : NULL;
+	if (!info || !GetLogicalProcessorInformation(info, &length))
+	{
+		if (info)
+		{
+			heap_free(heap, info);
+		}
+		return;
+	}
+
+	uint64_t first_core = 0;
+	int worker = 0;
+	for (DWORD i = 0; i < length / sizeof(*info); ++i)
+	{
+		if (info[i].Relationship != RelationProcessorCore)
+		{
+			continue;
+		}
+		uint64_t core = (uint64_t)info[i].ProcessorMask;
+		if (!first_core)
+		{
+			first_core = core;
+			continue;
+		}
+		for (uint64_t processors = core; processors && worker < worker_count; processors &= processors - 1)
+		{
+			masks[worker++] = core;
+		}
+	}
+	heap_free(heap, info);
+}
+
+job_system_t* job_system_create(heap_t* heap, int worker_count)
+{
+	SYSTEM_INFO system_info;
+	GetSystemInfo(&system_info);
+	int processor_count = (int)system_info.dwNumberOfProcessors;
+	if (worker_count <= 0)
+	{
+		worker_count = __max(processor_count - 1, 1);
+	}
+
+	job_system_t* jobs = heap_alloc(heap, sizeof(job_system_t), k_job_cache_line);
+	jobs->heap = heap;
+	jobs->job_pool = object_pool_create(heap, sizeof(job_t), k_job_pool_count);
+	jobs->injection = queue_create(heap, k_job_injection_capacity);
+	jobs->context_tls = TlsAlloc();
+	jobs->creator_converted = !IsThreadAFiber();
+	jobs->creator_context = (job_context_t) { .thread_fiber = jobs->creator_converted ? ConvertThreadToFiber(NULL) : GetCurrentFiber() };
+	TlsSetValue(jobs->context_tls, &jobs->creator_context);
+	jobs->work_epoch = 0;
+	jobs->sleepers = 0;
+	jobs->shutdown = 0;
+
+	jobs->fibers = heap_alloc(heap, sizeof(job_fiber_t) * k_job_fiber_count, 8);
+	jobs->free_fibers = queue_create(heap, k_job_fiber_count);
+	for (int i = 0; i < k_job_fiber_count; ++i)
+	{
+		job_fiber_t* fiber = &jobs->fibers[i];
+		fiber->fiber = CreateFiber(k_job_fiber_stack_size, job_fiber_func, fiber);
+		fiber->jobs = jobs;
+		fiber->job = NULL;
+		fiber->context = NULL;
+		queue_push(jobs->free_fibers, fiber);
+	}
+
+	jobs->worker_count = worker_count;
+	jobs->workers = heap_alloc(heap, sizeof(job_worker_t*) * worker_count, 8);
+	for (int i = 0; i < worker_count; ++i)
+	{
+		job_worker_t* worker = heap_alloc(heap, sizeof(job_worker_t), k_job_cache_line);
+		worker->top = 0;
+		worker->bottom = 0;
+		worker->jobs = jobs;
+		worker->index = i;
+		worker->thread = NULL;
+		worker->context = (job_context_t) { .worker = worker };
+		jobs->workers[i] = worker;
+	}
+
+	uint64_t* masks = heap_alloc(heap, sizeof(uint64_t) * worker_count, 8);
+	job_system_affinity_masks(heap, masks, worker_count);
+
+	// Start threads only once every deque exists, since workers steal from each other.
+	for (int i = 0; i < worker_count; ++i)
+	{
+		char name[32];
+		snprintf(name, sizeof(name), "job worker %d", i);
+		thread_options_t options =
+		{
+			.name = name,
+			.affinity_mask = masks[i],
+		};
+		jobs->workers[i]->thread = thread_create_ex(job_worker_thread_func, jobs->workers[i], &options);
+	}
+	heap_free(heap, masks);
+
+	return jobs;
+}
+
+void job_system_destroy(job_system_t* jobs)
+{
+	atomic_store_explicit(&jobs->shutdown, 1, k_atomic_seq_cst);
+	atomic_increment(&jobs->work_epoch);
+	WakeByAddressAll(&jobs->work_epoch);
+
+	for (int i = 0; i < jobs->worker_count; ++i)
+	{
+		thread_destroy(jobs->workers[i]->thread);
+		heap_free(jobs->heap, jobs->workers[i]);
+	}
+	heap_free(jobs->heap, jobs->workers);
+
+	for (int i = 0; i < k_job_fiber_count; ++i)
+	{
+		DeleteFiber(jobs->fibers[i].fiber);
+	}
+	queue_destroy(jobs->free_fibers);
+	heap_free(jobs->heap, jobs->fibers);
+
+	TlsSetValue(jobs->context_tls, NULL);
+	if (jobs->creator_converted)
+	{
+		ConvertFiberToThread();
+	}
+	TlsFree(jobs->context_tls);
+	queue_destroy(jobs->injection);
+	object_pool_destroy(jobs->job_pool);
+	heap_free(jobs->heap, jobs);
+}
+
+int job_system_get_thread_count(job_system_t* jobs)
+{
+	return jobs->worker_count + 1;
+}
+
+static void job_counter_lock(job_counter_t* counter)
+{
+	while (atomic_compare_and_exchange(&counter->lock, 0, 1) != 0)
+	{
+		YieldProcessor();
+	}
+}
+
+static void job_counter_unlock(job_counter_t* counter)
+{
+	atomic_store(&counter->lock, 0);
+}
+
+job_counter_t* job_counter_create(job_system_t* jobs)
+{
+	job_counter_t* counter = heap_alloc(jobs->heap, sizeof(job_counter_t), 8);
+	counter->value = 0;
+	counter->waiters = 0;
+	counter->lock = 0;
+	counter->dependents = NULL;
+	return counter;
+}
+
+void job_counter_destroy(job_system_t* jobs, job_counter_t* counter)
+{
+	// The job that lowered the counter to zero may still be releasing the lock.
+	while (atomic_load(&counter->lock))
+	{
+		YieldProcessor();
+	}
+	heap_free(jobs->heap, counter);
+}
+
+bool job_counter_is_done(job_counter_t* counter)
+{
+	return atomic_load(&counter->value) == 0;
+}
+
+// Wake one idle worker, if any are asleep.
+static void job_wake(job_system_t* jobs)
+{
+	// The job must be visible before sleepers is read; pairs with the
+	// increment of sleepers before a worker's last search.
+	atomic_fence(k_atomic_seq_cst);
+	if (atomic_load(&jobs->sleepers))
+	{
+		atomic_increment(&jobs->work_epoch);
+		WakeByAddressSingle(&jobs->work_epoch);
+	}
+}
+
+static void job_execute(job_system_t* jobs, job_t* job);
+
+// Make a job available to run: on the calling worker's deque, or the shared queue.
+static void job_submit(job_system_t* jobs, job_t* job)
+{
+	job_context_t* context = TlsGetValue(jobs->context_tls);
+	job_worker_t* worker = context ? context->worker : NULL;
+	if (!worker || !job_deque_push(worker, job))
+	{
+		if (worker && !job->fiber)
+		{
+			// A full deque means there is plenty of queued work; run this one now.
+			job_execute(jobs, job);
+			return;
+		}
+		queue_push(jobs->injection, job);
+	}
+	job_wake(jobs);
+}
+
+// Lower a counter, releasing its dependents and waiters when it reaches zero.
+static void job_counter_lower(job_system_t* jobs, job_counter_t* counter)
+{
+	while (true)
+	{
+		int value = atomic_load_explicit(&counter->value, k_atomic_relaxed);
+		if (value > 1)
+		{
+			if (atomic_compare_and_exchange(&counter->value, value, value - 1) == value)
+			{
+				return;
+			}
+			continue;
+		}
+
+		job_counter_lock(counter);
+		if (atomic_compare_and_exchange(&counter->value, 1, 0) != 1)
+		{
+			job_counter_unlock(counter);
+			continue;
+		}
+		job_t* dependents = counter->dependents;
+		counter->dependents = NULL;
+		bool wake = atomic_load(&counter->waiters) != 0;
+		job_counter_unlock(counter);
+
+		// The counter may be destroyed from here on; waking only uses its address.
+		while (dependents)
+		{
+			job_t* next = dependents->next;
+			job_submit(jobs, dependents);
+			dependents = next;
+		}
+		if (wake)
+		{
+			WakeByAddressAll(&counter->value);
+		}
+		return;
+	}
+}
+
+// Run a job on whatever stack the calling thread is on.
+static void job_execute(job_system_t* jobs, job_t* job)
+{
+	job->func(job->data);
+
+	job_counter_t* counter = job->counter;
+	object_pool_free(jobs->job_pool, job);
+	if (counter)
+	{
+		job_counter_lower(jobs, counter);
+	}
+}
+
+static void WINAPI job_fiber_func(void* user)
+{
+	job_fiber_t* fiber = user;
+	while (true)
+	{
+		job_execute(fiber->jobs, fiber->job);
+
+		// The job may have moved threads while it waited; report to the current one.
+		fiber->job = NULL;
+		fiber->context->action = k_job_action_release;
+		SwitchToFiber(fiber->context->thread_fiber);
+	}
+}
+
+// Switch from the running fiber back to its thread, asking the thread to do action.
+// Returns once some thread resumes the fiber.
+static void job_fiber_suspend(job_fiber_t* fiber, job_action_t action, job_counter_t* counter)
+{
+	job_context_t* context = fiber->context;
+	context->action = action;
+	context->wait_counter = counter;
+	SwitchToFiber(context->thread_fiber);
+}
+
+// Queue a suspended fiber to be resumed once counter reaches zero, or after
+// other work if counter is NULL.
+static void job_resume_later(job_system_t* jobs, job_fiber_t* fiber, job_counter_t* counter)
+{
+	job_t* continuation = object_pool_alloc(jobs->job_pool);
+	continuation->func = NULL;
+	continuation->data = NULL;
+	continuation->counter = NULL;
+	continuation->fiber = fiber;
+	continuation->next = NULL;
+
+	if (counter)
+	{
+		job_counter_lock(counter);
+		if (atomic_load(&counter->value))
+		{
+			continuation->next = counter->dependents;
+			counter->dependents = continuation;
+			job_counter_unlock(counter);
+			return;
+		}
+		job_counter_unlock(counter);
+	}
+
+	// Behind everything already queued, so a yield lets other jobs run first.
+	queue_push(jobs->injection, continuation);
+	job_wake(jobs);
+}
+
+// Run a job, or resume a continuation, on a fiber.
+// Must be called on the thread's own fiber; returns when the fiber switches back.
+static void job_dispatch(job_system_t* jobs, job_context_t* context, job_t* job)
+{
+	job_fiber_t* fiber = job->fiber;
+	if (fiber)
+	{
+		object_pool_free(jobs->job_pool, job);
+	}
+	else
+	{
+		fiber = queue_try_pop(jobs->free_fibers);
+		if (!fiber)
+		{
+			job_execute(jobs, job);
+			return;
+		}
+		fiber->job = job;
+	}
+
+	fiber->context = context;
+	context->current = fiber;
+	context->action = k_job_action_none;
+	SwitchToFiber(fiber->fiber);
+	context->current = NULL;
+
+	switch (context->action)
+	{
+	case k_job_action_release:
+		queue_push(jobs->free_fibers, fiber);
+		break;
+	case k_job_action_wait:
+		job_resume_later(jobs, fiber, context->wait_counter);
+		break;
+	case k_job_action_yield:
+		job_resume_later(jobs, fiber, NULL);
+		break;
+	default:
+		break;
+	}
+}
+
+// Find a job to run: the worker's own newest job, then the shared queue,
+// then the oldest job of another worker.
+static job_t* job_find(job_system_t* jobs, job_worker_t* worker)
+{
+	job_t* job = worker ? job_deque_pop(worker) : NULL;
+	if (job)
+	{
+		return job;
+	}
+
+	job = queue_try_pop(jobs->injection);
+	if (job)
+	{
+		return job;
+	}
+
+	int start = worker ? worker->index + 1 : 0;
+	for (int i = 0; i < jobs->worker_count; ++i)
+	{
+		job_worker_t* victim = jobs->workers[(start + i) % jobs->worker_count];
+		if (victim != worker)
+		{
+			job = job_deque_steal(victim);
+			if (job)
+			{
+				return job;
+			}
+		}
+	}
+	return NULL;
+}
+
+static job_t* job_create(job_system_t* jobs, job_func_t func, void* data, job_counter_t* counter)
+{
+	if (counter)
+	{
+		atomic_increment(&counter->value);
+	}
+
+	job_t* job = object_pool_alloc(jobs->job_pool);
+	job->func = func;
+	job->data = data;
+	job->counter = counter;
+	job->fiber = NULL;
+	job->next = NULL;
+	return job;
+}
+
+void job_run(job_system_t* jobs, job_func_t func, void* data, job_counter_t* counter)
+{
+	job_submit(jobs, job_create(jobs, func, data, counter));
+}
+
+void job_run_after(job_system_t* jobs, job_counter_t* dependency, job_func_t func, void* data, job_counter_t* counter)
+{
+	job_t* job = job_create(jobs, func, data, counter);
+
+	if (dependency)
+	{
+		job_counter_lock(dependency);
+		if (atomic_load(&dependency->value))
+		{
+			job->next = dependency->dependents;
+			dependency->dependents = job;
+			job_counter_unlock(dependency);
+			return;
+		}
+		job_counter_unlock(dependency);
+	}
+
+	job_submit(jobs, job);
+}
+
+void job_wait(job_system_t* jobs, job_counter_t* counter)
+{
+	if (!atomic_load(&counter->value))
+	{
+		return;
+	}
+
+	// Inside a job on a fiber: set the fiber aside and let the thread run other work.
+	job_context_t* context = TlsGetValue(jobs->context_tls);
+	if (context && context->current)
+	{
+		job_fiber_suspend(context->current, k_job_action_wait, counter);
+		return;
+	}
+
+	// Any other thread outside the pool has to become a fiber to run jobs on fibers.
+	job_context_t helper_context = { 0 };
+	bool converted = false;
+	if (!context)
+	{
+		converted = !IsThreadAFiber();
+		helper_context.thread_fiber = converted ? ConvertThreadToFiber(NULL) : GetCurrentFiber();
+		context = &helper_context;
+		TlsSetValue(jobs->context_tls, context);
+	}
+
+	int spins = 0;
+	while (atomic_load(&counter->value))
+	{
+		job_t* job = job_find(jobs, context->worker);
+		if (job)
+		{
+			job_dispatch(jobs, context, job);
+			spins = 0;
+			continue;
+		}
+
+		if (spins < k_job_spin_count)
+		{
+			++spins;
+			YieldProcessor();
+			continue;
+		}
+
+		// Registering as a waiter before the final check pairs with
+		// job_counter_lower reading waiters after it reaches zero.
+		// The workers run whatever is left, so sleep until then.
+		atomic_increment(&counter->waiters);
+		int value = atomic_load(&counter->value);
+		if (value)
+		{
+			WaitOnAddress(&counter->value, &value, sizeof(value), INFINITE);
+		}
+		atomic_decrement(&counter->waiters);
+		spins = 0;
+	}
+
+	if (context == &helper_context)
+	{
+		TlsSetValue(jobs->context_tls, NULL);
+		if (converted)
+		{
+			ConvertFiberToThread();
+		}
+	}
+}
+
+void job_yield(job_system_t* jobs)
+{
+	job_context_t* context = TlsGetValue(jobs->context_tls);
+	if (context && context->current)
+	{
+		job_fiber_suspend(context->current, k_job_action_yield, NULL);
+	}
+	else
+	{
+		SwitchToThread();
+	}
+}
+
+static int job_worker_thread_func(void* user)
+{
+	job_worker_t* worker = user;
+	job_system_t* jobs = worker->jobs;
+	job_context_t* context = &worker->context;
+	context->thread_fiber = ConvertThreadToFiber(NULL);
+	TlsSetValue(jobs->context_tls, context);
+
+	int spins = 0;
+	while (!atomic_load(&jobs->shutdown))
+	{
+		job_t* job = job_find(jobs, worker);
+		if (!job && spins < k_job_spin_count)
+		{
+			++spins;
+			YieldProcessor();
+			continue;
+		}
+
+		if (!job)
+		{
+			// Read the epoch, announce we may sleep,
+			// then search once more so a job submitted meanwhile can't be missed.
+			int epoch = atomic_load(&jobs->work_epoch);
+			atomic_increment(&jobs->sleepers);
+			job = job_find(jobs, worker);
+			if (!job && !atomic_load(&jobs->shutdown))
+			{
+				WaitOnAddress(&jobs->work_epoch, &epoch, sizeof(epoch), INFINITE);
+			}
+			atomic_decrement(&jobs->sleepers);
+		}
+
+		if (job)
+		{
+			job_dispatch(jobs, context, job);
+		}
+		spins = 0;
+	}
+
+	ConvertFiberToThread();
+	return 0;
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <stdbool.h>
+
+// Work-stealing job system
+//
+// Main object, job_system_t, runs small functions (jobs) on a pool of worker
+// threads. Each worker keeps its own deque of jobs: it pushes and pops the
+// newest jobs at one end, and idle workers steal the oldest from the other.
+// Jobs submitted by threads outside the pool go through a shared queue.
+//
+// Completion is tracked with counters. Each job may name a counter that is
+// raised when the job is submitted and lowered when it finishes; job_wait
+// runs other jobs until the counter drops to zero. A job may also be held
+// back until another counter reaches zero, which expresses dependencies.
+//
+// Jobs run on fibers. A job that calls job_wait or job_yield is set aside,
+// without blocking its thread, and resumes later, possibly on another
+// thread. Jobs must therefore not hold locks across those calls.
+// For example, a job can load a file without tying up a thread:
+//   while (!fs_work_is_done(work)) job_yield(jobs);
+
+// Handle to a job system.
+typedef struct job_system_t job_system_t;
+
+// Handle to a job completion counter.
+typedef struct job_counter_t job_counter_t;
+
+typedef struct heap_t heap_t;
+
+// Function run by a job.
+typedef void (*job_func_t)(void* data);
+
+// Create a job system with the given number of worker threads.
+// If worker_count is zero or less, creates one worker per logical processor,
+// minus one for the calling thread, which is expected to help out in job_wait.
+// Workers are pinned to the physical cores after the first, one per logical
+// processor, leaving the first core for the calling thread. The calling thread's
+// own affinity is not changed. Workers left over, and processors in other
+// processor groups, are not pinned.
+// The calling thread is made a fiber, if it isn't one, until job_system_destroy.
+job_system_t* job_system_create(heap_t* heap, int worker_count);
+
+// Destroy a job system, stopping its workers.
+// All submitted jobs must have finished.
+// Must be called on the thread that created the job system.
+void job_system_destroy(job_system_t* jobs);
+
+// Number of threads that can run jobs: the workers plus the calling thread.
+int job_system_get_thread_count(job_system_t* jobs);
+
+// Create a counter at zero.
+job_counter_t* job_counter_create(job_system_t* jobs);
+
+// Destroy a counter.
+// The counter must be at zero and no jobs may still refer to it.
+void job_counter_destroy(job_system_t* jobs, job_counter_t* counter);
+
+// Determines if all jobs tracked by a counter have finished.
+bool job_counter_is_done(job_counter_t* counter);
+
+// Submit a job that runs func(data).
+// If counter is not NULL, it is raised now and lowered when the job finishes.
+// Safe to call from any thread, including from inside a job.
+void job_run(job_system_t* jobs, job_func_t func, void* data, job_counter_t* counter);
+
+// Submit a job that runs func(data) once dependency reaches zero.
+// If dependency is already zero, acts like job_run.
+void job_run_after(job_system_t* jobs, job_counter_t* dependency, job_func_t func, void* data, job_counter_t* counter);
+
+// Wait for a counter to reach zero.
+// Inside a job, the job is suspended until then and its thread moves on.
+// Elsewhere, the calling thread runs pending jobs while it waits; this is how
+// non-worker threads contribute.
+void job_wait(job_system_t* jobs, job_counter_t* counter);
+
+// Let other jobs run before continuing.
+// Inside a job, the job is suspended and queued behind pending work.
+// Elsewhere, gives up the rest of the thread's time slice.
+void job_yield(job_system_t* jobs);
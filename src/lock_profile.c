@@ -0,0 +1,169 @@
+#include "lock_profile.h"
+
+#include "timer.h"
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+#include <string.h>
+
+enum
+{
+	k_lock_profile_capacity = 64,
+	k_lock_profile_name_size = 32,
+};
+
+typedef struct lock_profile_t
+{
+	char name[k_lock_profile_name_size];
+	LONG64 acquire_count;
+	LONG64 contended_count;
+	LONG64 wait_ticks;
+	LONG64 max_wait_ticks;
+	LONG64 hold_ticks;
+} lock_profile_t;
+
+// Profiles live for the whole process, since locks come and go under the same names.
+// Locks are created from inside the heap, so none of this may allocate from it,
+// and the table lock is an SRW lock so it isn't itself profiled.
+static lock_profile_t s_profiles[k_lock_profile_capacity];
+static LONG s_profile_count = 0;
+static SRWLOCK s_profiles_lock = SRWLOCK_INIT;
+
+static volatile LONG s_recording = 0;
+static lock_profile_wait_t s_waits[k_lock_profile_wait_capacity];
+static LONG s_wait_count = 0;
+
+lock_profile_t* lock_profile_get(const char* name)
+{
+	// Locks are usually created under names that already exist.
+	AcquireSRWLockShared(&s_profiles_lock);
+	for (LONG i = 0; i < s_profile_count; ++i)
+	{
+		if (strncmp(s_profiles[i].name, name, k_lock_profile_name_size - 1) == 0)
+		{
+			ReleaseSRWLockShared(&s_profiles_lock);
+			return &s_profiles[i];
+		}
+	}
+	ReleaseSRWLockShared(&s_profiles_lock);
+
+	lock_profile_t* profile = NULL;
+	AcquireSRWLockExclusive(&s_profiles_lock);
+	for (LONG i = 0; i < s_profile_count; ++i)
+	{
+		if (strncmp(s_profiles[i].name, name, k_lock_profile_name_size - 1) == 0)
+		{
+			profile = &s_profiles[i];
+			break;
+		}
+	}
+	if (profile == NULL && s_profile_count < k_lock_profile_capacity)
+	{
+		profile = &s_profiles[s_profile_count];
+		strncpy_s(profile->name, sizeof(profile->name), name, _TRUNCATE);
+		++s_profile_count;
+	}
+	ReleaseSRWLockExclusive(&s_profiles_lock);
+	return profile;
+}
+
+void lock_profile_start()
+{
+	InterlockedExchange(&s_recording, 0);
+
+	AcquireSRWLockShared(&s_profiles_lock);
+	for (LONG i = 0; i < s_profile_count; ++i)
+	{
+		lock_profile_t* profile = &s_profiles[i];
+		InterlockedExchange64(&profile->acquire_count, 0);
+		InterlockedExchange64(&profile->contended_count, 0);
+		InterlockedExchange64(&profile->wait_ticks, 0);
+		InterlockedExchange64(&profile->max_wait_ticks, 0);
+		InterlockedExchange64(&profile->hold_ticks, 0);
+	}
+	ReleaseSRWLockShared(&s_profiles_lock);
+	InterlockedExchange(&s_wait_count, 0);
+
+	InterlockedExchange(&s_recording, 1);
+}
+
+void lock_profile_stop()
+{
+	InterlockedExchange(&s_recording, 0);
+}
+
+bool lock_profile_is_recording()
+{
+	return s_recording != 0;
+}
+
+uint64_t lock_profile_acquired(lock_profile_t* profile, bool contended, uint64_t wait_start)
+{
+	uint64_t now = timer_get_ticks();
+	InterlockedIncrement64(&profile->acquire_count);
+	if (!contended)
+	{
+		return now;
+	}
+
+	LONG64 wait = (LONG64)(now - wait_start);
+	LONG64 contended_count = InterlockedIncrement64(&profile->contended_count);
+	LONG64 total_wait = InterlockedAdd64(&profile->wait_ticks, wait);
+	LONG64 max_wait = profile->max_wait_ticks;
+	while (wait > max_wait)
+	{
+		LONG64 observed = InterlockedCompareExchange64(&profile->max_wait_ticks, wait, max_wait);
+		if (observed == max_wait)
+		{
+			break;
+		}
+		max_wait = observed;
+	}
+
+	// Waits past capacity still count toward the totals, they just get no slice.
+	LONG index = InterlockedIncrement(&s_wait_count) - 1;
+	if (index < k_lock_profile_wait_capacity)
+	{
+		lock_profile_wait_t* record = &s_waits[index];
+		record->name = profile->name;
+		record->tid = (int)GetCurrentThreadId();
+		record->start_ticks = wait_start;
+		record->wait_ticks = (uint64_t)wait;
+		record->contended_count = (uint64_t)contended_count;
+		record->total_wait_ticks = (uint64_t)total_wait;
+		record->total_hold_ticks = (uint64_t)profile->hold_ticks;
+	}
+	return now;
+}
+
+void lock_profile_released(lock_profile_t* profile, uint64_t hold_start)
+{
+	InterlockedAdd64(&profile->hold_ticks, (LONG64)(timer_get_ticks() - hold_start));
+}
+
+int lock_profile_get_stats(lock_profile_stats_t* stats, int capacity)
+{
+	int count = 0;
+	AcquireSRWLockShared(&s_profiles_lock);
+	for (LONG i = 0; i < s_profile_count && count < capacity; ++i)
+	{
+		lock_profile_t* profile = &s_profiles[i];
+		stats[count].name = profile->name;
+		stats[count].acquire_count = (uint64_t)profile->acquire_count;
+		stats[count].contended_count = (uint64_t)profile->contended_count;
+		stats[count].wait_ticks = (uint64_t)profile->wait_ticks;
+		stats[count].max_wait_ticks = (uint64_t)profile->max_wait_ticks;
+		stats[count].hold_ticks = (uint64_t)profile->hold_ticks;
+		++count;
+	}
+	ReleaseSRWLockShared(&s_profiles_lock);
+	return count;
+}
+
+const lock_profile_wait_t* lock_profile_get_waits(int* count)
+{
+	LONG wait_count = s_wait_count;
+	*count = wait_count < k_lock_profile_wait_capacity ? (int)wait_count : k_lock_profile_wait_capacity;
+	return s_waits;
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Lock contention profiling
+//
+// Named mutexes, semaphores and events report how often they are taken,
+// how often a taker had to wait and for how long, and how long mutexes are
+// held. Locks that share a name share statistics. Nothing is recorded while
+// profiling is stopped, and unnamed locks never pay for it.
+//
+// The trace system starts profiling with each capture and writes the waits
+// as slices and the running totals as counters.
+
+enum
+{
+	// Most waits recorded per profile; later waits still count in the statistics.
+	k_lock_profile_wait_capacity = 16384,
+};
+
+// Statistics shared by all locks with one name.
+typedef struct lock_profile_t lock_profile_t;
+
+// Snapshot of one name's statistics. Times are in timer ticks.
+typedef struct lock_profile_stats_t
+{
+	const char* name;
+	uint64_t acquire_count;
+	uint64_t contended_count;
+	uint64_t wait_ticks;
+	uint64_t max_wait_ticks;
+	uint64_t hold_ticks;
+} lock_profile_stats_t;
+
+// One acquire that had to wait, with the lock's running totals as of its end.
+typedef struct lock_profile_wait_t
+{
+	const char* name;
+	int tid;
+	uint64_t start_ticks;
+	uint64_t wait_ticks;
+	uint64_t contended_count;
+	uint64_t total_wait_ticks;
+	uint64_t total_hold_ticks;
+} lock_profile_wait_t;
+
+// Finds or creates the statistics for a lock name. The name is copied.
+// Returns NULL if too many names are in use.
+lock_profile_t* lock_profile_get(const char* name);
+
+// Clears all statistics and recorded waits, then starts recording.
+void lock_profile_start();
+
+// Stops recording. Statistics and waits remain readable.
+void lock_profile_stop();
+
+// Determines if lock activity is being recorded.
+bool lock_profile_is_recording();
+
+// Records an acquire of a profiled lock.
+// If the caller had to wait, wait_start is the time it started waiting.
+// Returns the current time, for passing to lock_profile_released.
+uint64_t lock_profile_acquired(lock_profile_t* profile, bool contended, uint64_t wait_start);
+
+// Records the release of a profiled lock that was acquired at hold_start.
+void lock_profile_released(lock_profile_t* profile, uint64_t hold_start);
+
+// Copies out the statistics of up to capacity lock names.
+// Returns the number of names copied.
+int lock_profile_get_stats(lock_profile_stats_t* stats, int capacity);
+
+// Returns the waits recorded since profiling started and stores their number in count.
+// Should only be called while profiling is stopped.
+const lock_profile_wait_t* lock_profile_get_waits(int* count);
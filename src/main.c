@@ -1,33 +1,79 @@
+#include "bench.h"
 #include "debug.h"
 #include "fs.h"
 #include "heap.h"
+#include "job.h"
 #include "render.h"
 #include "simple_game.h"
 #include "frogger_game.h"
+#include "thread.h"
 #include "timer.h"
 #include "wm.h"
 
 #include "cpp_test.h"
 
+#include <string.h>
+
 int main(int argc, const char* argv[])
 {
 	debug_set_print_mask(k_print_info | k_print_warning | k_print_error);
 	debug_install_exception_handler();
 
 	timer_startup();
+	thread_set_name("main");
 
 	cpp_test_function(42);
 
-	heap_t* heap = heap_create(2 * 1024 * 1024);
+	// "--large-pages" backs the main heap with large pages. They are committed and locked
+	// up front and can't be trimmed, so they are only used when asked for.
+	uint32_t heap_flags = 0;
+	for (int i = 1; i < argc; ++i)
+	{
+		if (strcmp(argv[i], "--large-pages") == 0)
+		{
+			heap_flags |= k_heap_reserve_large_pages;
+		}
+	}
+
+	// One contiguous range keeps ECS component arrays and their neighbors in a single pool.
+	heap_t* heap = heap_create_reserved(256 * 1024 * 1024, 2 * 1024 * 1024, heap_flags);
 	fs_t* fs = fs_create(heap, 8);
+	job_system_t* jobs = job_system_create(heap, 0);
+
+	// "--bench [path]" times synchronization primitives instead of running the game.
+	if (argc >= 2 && strcmp(argv[1], "--bench") == 0)
+	{
+		bench_run(heap, fs, jobs, argc >= 3 ? argv[2] : "bench.json");
+		job_system_destroy(jobs);
+		fs_destroy(fs);
+		heap_destroy(heap);
+		return 0;
+	}
+
 	wm_window_t* window = wm_create(heap);
 	render_t* render = render_create(heap, window);
 
-	frogger_game_t* game = frogger_game_create(heap, fs, window, render);
+	frogger_game_t* game = frogger_game_create(heap, fs, jobs, window, render);
 
+	uint64_t stats_ticks = timer_get_ticks();
+	uint64_t trim_ticks = timer_get_ticks();
 	while (!wm_pump(window))
 	{
 		frogger_game_update(game);
+
+		// Periodically log memory usage so growth shows up without a debugger.
+		if (timer_ticks_to_ms(timer_get_ticks() - stats_ticks) >= 5000)
+		{
+			heap_print_stats(heap);
+			stats_ticks = timer_get_ticks();
+		}
+
+		// Give memory from load spikes back to the OS once it has stayed free for a few seconds.
+		if (timer_ticks_to_ms(timer_get_ticks() - trim_ticks) >= 1000)
+		{
+			heap_trim(heap);
+			trim_ticks = timer_get_ticks();
+		}
 	}
 
 	/* XXX: Shutdown render before the game. Render uses game resources. */
@@ -36,7 +82,11 @@ int main(int argc, const char* argv[])
 	frogger_game_destroy(game);
 
 	wm_destroy(window);
+	job_system_destroy(jobs);
 	fs_destroy(fs);
+
+	heap_print_stats(heap);
+
 	heap_destroy(heap);
 
 	return 0;
@@ -1,24 +1,153 @@
 #include "mutex.h"
 
+#include "lock_profile.h"
+#include "timer.h"
+
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
 
+#pragma comment(lib, "Synchronization.lib")
+
+enum
+{
+	k_mutex_unlocked,
+	k_mutex_locked,
+	// Locked and at least one thread may be parked on the state word.
+	k_mutex_contended,
+};
+
+enum
+{
+	// Bounds on how long a locker spins before parking.
+	k_mutex_spin_min = 16,
+	k_mutex_spin_max = 4096,
+};
+
+typedef struct mutex_t
+{
+	LONG state;
+	// Thread that holds the lock, or zero. Only compared against the calling thread.
+	DWORD owner;
+	int recursion;
+	// Running estimate of spins that pay off, adjusted by each contended lock.
+	LONG spin_limit;
+	// Statistics for a named mutex, and when the current hold was recorded as starting.
+	lock_profile_t* profile;
+	uint64_t hold_start;
+} mutex_t;
+
 mutex_t* mutex_create()
 {
-	return (mutex_t*)CreateMutex(NULL, FALSE, NULL);
+	// Mutexes guard the heap itself, so they come from the process heap.
+	mutex_t* mutex = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(mutex_t));
+	mutex->spin_limit = k_mutex_spin_min * 4;
+	return mutex;
 }
 
 void mutex_destroy(mutex_t* mutex)
 {
-	CloseHandle(mutex);
+	HeapFree(GetProcessHeap(), 0, mutex);
+}
+
+void mutex_set_name(mutex_t* mutex, const char* name)
+{
+	mutex->profile = lock_profile_get(name);
+}
+
+static void mutex_lock_contended(mutex_t* mutex)
+{
+	// Spin while the holder is likely to release soon.
+	// Nudge the spin limit toward what this attempt needed, so locks held
+	// briefly keep spinning and locks held long give up early.
+	LONG limit = *(volatile LONG*)&mutex->spin_limit;
+	for (LONG spins = 0; spins < limit; ++spins)
+	{
+		YieldProcessor();
+		if (*(volatile LONG*)&mutex->state == k_mutex_unlocked &&
+			InterlockedCompareExchange(&mutex->state, k_mutex_locked, k_mutex_unlocked) == k_mutex_unlocked)
+		{
+			LONG target = min(spins * 2 + k_mutex_spin_min, k_mutex_spin_max);
+			mutex->spin_limit = limit + (target - limit) / 8;
+			return;
+		}
+	}
+	mutex->spin_limit = max(limit - limit / 8, k_mutex_spin_min);
+
+	// Park. Marking the word contended makes the unlocker wake us; since we
+	// cannot tell if other waiters remain, we keep it contended once we get in.
+	while (InterlockedExchange(&mutex->state, k_mutex_contended) != k_mutex_unlocked)
+	{
+		LONG contended = k_mutex_contended;
+		WaitOnAddress(&mutex->state, &contended, sizeof(contended), INFINITE);
+	}
 }
 
 void mutex_lock(mutex_t* mutex)
 {
-	WaitForSingleObject(mutex, INFINITE);
+	DWORD thread = GetCurrentThreadId();
+	if (*(volatile DWORD*)&mutex->owner == thread)
+	{
+		++mutex->recursion;
+		return;
+	}
+
+	bool contended = false;
+	uint64_t wait_start = 0;
+	if (InterlockedCompareExchange(&mutex->state, k_mutex_locked, k_mutex_unlocked) != k_mutex_unlocked)
+	{
+		contended = true;
+		wait_start = mutex->profile ? timer_get_ticks() : 0;
+		mutex_lock_contended(mutex);
+	}
+	mutex->owner = thread;
+	mutex->recursion = 1;
+
+	if (mutex->profile && lock_profile_is_recording())
+	{
+		mutex->hold_start = lock_profile_acquired(mutex->profile, contended, wait_start);
+	}
+}
+
+bool mutex_try_lock(mutex_t* mutex)
+{
+	DWORD thread = GetCurrentThreadId();
+	if (*(volatile DWORD*)&mutex->owner == thread)
+	{
+		++mutex->recursion;
+		return true;
+	}
+
+	if (InterlockedCompareExchange(&mutex->state, k_mutex_locked, k_mutex_unlocked) != k_mutex_unlocked)
+	{
+		return false;
+	}
+	mutex->owner = thread;
+	mutex->recursion = 1;
+
+	if (mutex->profile && lock_profile_is_recording())
+	{
+		mutex->hold_start = lock_profile_acquired(mutex->profile, false, 0);
+	}
+	return true;
 }
 
 void mutex_unlock(mutex_t* mutex)
 {
-	ReleaseMutex(mutex);
+	if (--mutex->recursion)
+	{
+		return;
+	}
+
+	// Holds that began before recording started are not counted.
+	if (mutex->hold_start)
+	{
+		lock_profile_released(mutex->profile, mutex->hold_start);
+		mutex->hold_start = 0;
+	}
+
+	mutex->owner = 0;
+	if (InterlockedExchange(&mutex->state, k_mutex_unlocked) == k_mutex_contended)
+	{
+		WakeByAddressSingle(&mutex->state);
+	}
 }
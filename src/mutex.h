@@ -1,6 +1,11 @@
 #pragma once
 
+#include <stdbool.h>
+
 // Recursive mutex thread synchronization
+//
+// Locking and unlocking an uncontended mutex is a single atomic operation.
+// A contended lock spins briefly, then sleeps until the holder unlocks.
 
 // Handle to a mutex.
 typedef struct mutex_t mutex_t;
@@ -11,10 +16,17 @@ mutex_t* mutex_create();
 // Destroys a previously created mutex.
 void mutex_destroy(mutex_t* mutex);
 
+// Names a mutex for lock contention profiling. See lock_profile.h.
+void mutex_set_name(mutex_t* mutex, const char* name);
+
 // Locks a mutex. May block if another thread unlocks it.
 // If a thread locks a mutex multiple times, it must be unlocked
 // multiple times.
 void mutex_lock(mutex_t* mutex);
 
+// Locks a mutex if no other thread holds it, without blocking.
+// Returns true if the mutex was locked; it must then be unlocked.
+bool mutex_try_lock(mutex_t* mutex);
+
 // Unlocks a mutex.
 void mutex_unlock(mutex_t* mutex);
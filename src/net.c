@@ -2,8 +2,9 @@
 
 #include "debug.h"
 #include "heap.h"
-#include "mutex.h"
-#include "queue.h"
+#include "rwlock.h"
+#include "object_pool.h"
+#include "queue_spsc.h"
 #include "thread.h"
 #include "timer.h"
 
@@ -22,6 +23,10 @@ enum
 	k_max_entity_types = 32,
 	k_max_snapshots = 256,
 	k_max_entities = 32,
+	k_max_packets = 64,
+
+	// Net state, packets and queues come from a child heap of this size.
+	k_net_heap_budget = 2 * 1024 * 1024,
 };
 
 typedef struct entity_type_t
@@ -77,8 +82,8 @@ typedef struct connection_t
 
 	thread_t* send_thread;
 
-	queue_t* send_queue;
-	queue_t* recv_queue;
+	queue_spsc_t* send_queue;
+	queue_spsc_t* recv_queue;
 
 	uint32_t last_recv_ms;
 
@@ -95,7 +100,10 @@ typedef struct net_t
 	SOCKET sock;
 	thread_t* recv_thread;
 
-	mutex_t* connections_mutex;
+	object_pool_t* packet_pool;
+
+	// Written only when a connection is created or dropped; every datagram and frame reads it.
+	rwlock_t* connections_lock;
 	connection_t connections[3];
 
 	entity_type_t entity_types[k_max_entity_types];
@@ -113,16 +121,19 @@ static void packet_recv(connection_t* connection);
 
 net_t* net_create(heap_t* heap, ecs_t* ecs)
 {
-	net_t* net = heap_alloc(heap, sizeof(net_t), 8);
+	// Packets piling up in receive queues fail their own allocations rather than starve other systems.
+	heap = heap_create_child(heap, k_net_heap_budget, k_heap_tag_net, NULL, NULL);
+	net_t* net = heap_alloc_tagged(heap, sizeof(net_t), 8, k_heap_tag_net);
 	memset(net, 0, sizeof(net_t));
 	net->heap = heap;
 	net->ecs = ecs;
+	net->packet_pool = object_pool_create(heap, sizeof(packet_t), k_max_packets);
 
 	WSADATA data;
 	WSAStartup(MAKEWORD(2, 2), &data);
 
 	net->sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
-	net->connections_mutex = mutex_create();
+	net->connections_lock = rwlock_create(heap);
 
 	struct sockaddr_in address;
 	address.sin_family = AF_INET;
@@ -134,7 +145,7 @@ net_t* net_create(heap_t* heap, ecs_t* ecs)
 	getsockname(net->sock, (struct sockaddr*)&address, &address_len);
 	debug_print(k_print_info, "Net bound port %d\n", ntohs(address.sin_port));
 
-	net->recv_thread = thread_create(recv_thread_func, net);
+	net->recv_thread = thread_create_ex(recv_thread_func, net, &(thread_options_t) { .name = "net recv", .priority = k_thread_priority_high });
 
 	return net;
 }
@@ -145,14 +156,18 @@ void net_destroy(net_t* net)
 	closesocket(net->sock);
 	thread_destroy(net->recv_thread);
 	WSACleanup();
-	mutex_destroy(net->connections_mutex);
-	heap_free(net->heap, net);
+	rwlock_destroy(net->connections_lock);
+	object_pool_destroy(net->packet_pool);
+	heap_t* heap = net->heap;
+	heap_free(heap, net);
+	heap_destroy(heap);
 }
 
 void net_update(net_t* net)
 {
 	timeout_old_connections(net);
 	snapshot_entities(net);
+	rwlock_lock_read(net->connections_lock);
 	for (int i = 0; i < _countof(net->connections); ++i)
 	{
 		connection_t* c = &net->connections[i];
@@ -162,6 +177,7 @@ void net_update(net_t* net)
 			packet_recv(c);
 		}
 	}
+	rwlock_unlock_read(net->connections_lock);
 	net->sequence++;
 }
 
@@ -172,22 +188,22 @@ void net_connect(net_t* net, const net_address_t* address)
 
 void net_disconnect_all(net_t* net)
 {
-	mutex_lock(net->connections_mutex);
+	rwlock_lock_write(net->connections_lock);
 
 	for (int i = 0; i < _countof(net->connections); ++i)
 	{
 		connection_t* c = &net->connections[i];
 		if (c->address.port)
 		{
-			queue_push(c->send_queue, NULL);
+			queue_spsc_push(c->send_queue, NULL);
 			thread_destroy(c->send_thread);
-			queue_destroy(c->send_queue);
-			queue_destroy(c->recv_queue);
+			queue_spsc_destroy(c->send_queue);
+			queue_spsc_destroy(c->recv_queue);
 		}
 	}
 	memset(net->connections, 0, sizeof(net->connections));
 
-	mutex_unlock(net->connections_mutex);
+	rwlock_unlock_write(net->connections_lock);
 }
 
 void net_state_register_entity_type(net_t* net, int type, uint64_t component_mask, uint64_t replicated_component_mask, net_configure_entity_callback_t configure_callback, void* configure_callback_data)
@@ -283,7 +299,7 @@ static int send_thread_func(void* user)
 
 	while (true)
 	{
-		packet_t* packet = queue_pop(connection->send_queue);
+		packet_t* packet = queue_spsc_pop(connection->send_queue);
 		if (!packet)
 		{
 			break;
@@ -293,7 +309,7 @@ static int send_thread_func(void* user)
 			packet->data, packet->size, 0,
 			(struct sockaddr*)&address, sizeof(address));
 
-		heap_free(connection->net->heap, packet);
+		object_pool_free(connection->net->packet_pool, packet);
 
 		if (bytes <= 0)
 		{
@@ -304,21 +320,34 @@ static int send_thread_func(void* user)
 	return 0;
 }
 
-static connection_t* find_or_create_connection(net_t* net, const net_address_t* address)
+static connection_t* find_connection_locked(net_t* net, const net_address_t* address)
 {
-	connection_t* result = NULL;
-
-	mutex_lock(net->connections_mutex);
-
 	for (int i = 0; i < _countof(net->connections); ++i)
 	{
 		connection_t* c = &net->connections[i];
 		if (memcmp(&c->address, address, sizeof(net_address_t)) == 0)
 		{
-			result = c;
-			break;
+			return c;
 		}
 	}
+	return NULL;
+}
+
+static connection_t* find_or_create_connection(net_t* net, const net_address_t* address)
+{
+	// Nearly every datagram is from a known peer, so look it up under the shared lock first.
+	rwlock_lock_read(net->connections_lock);
+	connection_t* result = find_connection_locked(net, address);
+	rwlock_unlock_read(net->connections_lock);
+	if (result)
+	{
+		return result;
+	}
+
+	// Another thread may have added the peer between the two locks.
+	rwlock_lock_write(net->connections_lock);
+
+	result = find_connection_locked(net, address);
 	if (!result)
 	{
 		for (int i = 0; i < _countof(net->connections); ++i)
@@ -331,9 +360,9 @@ static connection_t* find_or_create_connection(net_t* net, const net_address_t*
 				c->incoming_sequence = -1;
 				c->ack_sequence = -1;
 				c->last_recv_ms = timer_ticks_to_ms(timer_get_ticks());
-				c->send_queue = queue_create(net->heap, 3);
-				c->recv_queue = queue_create(net->heap, 3);
-				c->send_thread = thread_create(send_thread_func, c);
+				c->send_queue = queue_spsc_create(net->heap, 3);
+				c->recv_queue = queue_spsc_create(net->heap, 3);
+				c->send_thread = thread_create_ex(send_thread_func, c, &(thread_options_t) { .name = "net send" });
 
 				result = c;
 				break;
@@ -341,7 +370,7 @@ static connection_t* find_or_create_connection(net_t* net, const net_address_t*
 		}
 	}
 
-	mutex_unlock(net->connections_mutex);
+	rwlock_unlock_write(net->connections_lock);
 
 	return result;
 }
@@ -352,7 +381,17 @@ static int recv_thread_func(void* user)
 
 	while (true)
 	{
-		packet_t* packet = heap_alloc(net->heap, sizeof(packet_t), 8);
+		packet_t* packet = object_pool_alloc(net->packet_pool);
+		if (!packet)
+		{
+			// Out of packets; still receive the datagram so it is dropped rather than spun on.
+			char discard[k_net_mtu];
+			if (recvfrom(net->sock, discard, sizeof(discard), 0, NULL, NULL) <= 0)
+			{
+				break;
+			}
+			continue;
+		}
 
 		struct sockaddr_in address;
 		int address_len = sizeof(address);
@@ -361,7 +400,7 @@ static int recv_thread_func(void* user)
 			(struct sockaddr*)&address, &address_len);
 		if (bytes <= 0)
 		{
-			heap_free(net->heap, packet);
+			object_pool_free(net->packet_pool, packet);
 			break;
 		}
 
@@ -378,12 +417,15 @@ static int recv_thread_func(void* user)
 		if (!connection)
 		{
 			debug_print(k_print_info, "Too many connections!\n");
-			heap_free(net->heap, packet);
+			object_pool_free(net->packet_pool, packet);
 			continue;
 		}
 		connection->last_recv_ms = timer_ticks_to_ms(timer_get_ticks());
 
-		queue_try_push(connection->recv_queue, packet);
+		if (!queue_spsc_try_push(connection->recv_queue, packet))
+		{
+			object_pool_free(net->packet_pool, packet);
+		}
 	}
 
 	return 0;
@@ -391,9 +433,23 @@ static int recv_thread_func(void* user)
 
 static void timeout_old_connections(net_t* net)
 {
-	mutex_lock(net->connections_mutex);
-
+	// Checked every frame but rarely true, so only take the exclusive lock when something expired.
 	uint32_t now = timer_ticks_to_ms(timer_get_ticks());
+	bool expired = false;
+	rwlock_lock_read(net->connections_lock);
+	for (int i = 0; i < _countof(net->connections) && !expired; ++i)
+	{
+		connection_t* c = &net->connections[i];
+		expired = c->address.port && c->last_recv_ms + k_timeout_ms < now;
+	}
+	rwlock_unlock_read(net->connections_lock);
+	if (!expired)
+	{
+		return;
+	}
+
+	rwlock_lock_write(net->connections_lock);
+
 	for (int i = 0; i < _countof(net->connections); ++i)
 	{
 		connection_t* c = &net->connections[i];
@@ -401,15 +457,15 @@ static void timeout_old_connections(net_t* net)
 		{
 			debug_print(k_print_info, "Disconnecting old connection.\n");
 
-			queue_push(c->send_queue, NULL);
+			queue_spsc_push(c->send_queue, NULL);
 			thread_destroy(c->send_thread);
-			queue_destroy(c->send_queue);
-			queue_destroy(c->recv_queue);
+			queue_spsc_destroy(c->send_queue);
+			queue_spsc_destroy(c->recv_queue);
 			memset(c, 0, sizeof(*c));
 		}
 	}
 
-	mutex_unlock(net->connections_mutex);
+	rwlock_unlock_write(net->connections_lock);
 }
 
 static void snapshot_entities(net_t* net)
@@ -507,7 +563,12 @@ static void packet_send(connection_t* connection)
 {
 	net_t* net = connection->net;
 
-	packet_t* packet = heap_alloc(net->heap, sizeof(packet_t), 8);
+	packet_t* packet = object_pool_alloc(net->packet_pool);
+	if (!packet)
+	{
+		// A packet goes out every update, so skipping one only delays the peer.
+		return;
+	}
 
 	packet_header_t header =
 	{
@@ -519,7 +580,7 @@ static void packet_send(connection_t* connection)
 	packet->size = sizeof(header);
 	packet->size += (int)packet_add_entities(connection, &packet->data[packet->size], sizeof(packet->data) - packet->size);
 
-	queue_push(connection->send_queue, packet);
+	queue_spsc_push(connection->send_queue, packet);
 }
 
 static void packet_read_entities(connection_t* connection, char* packet, size_t packet_size)
@@ -600,9 +661,10 @@ static void packet_recv(connection_t* connection)
 
 	while (true)
 	{
-		packet_t* packet = queue_try_pop(connection->recv_queue);
+		packet_t* packet = queue_spsc_try_pop(connection->recv_queue);
 		if (!packet || !packet->size)
 		{
+			object_pool_free(net->packet_pool, packet);
 			break;
 		}
 
@@ -610,6 +672,7 @@ static void packet_recv(connection_t* connection)
 		memcpy(&header, packet->data, sizeof(header));
 		if (header.sequence <= connection->incoming_sequence)
 		{
+			object_pool_free(net->packet_pool, packet);
 			continue;
 		}
 
@@ -618,6 +681,6 @@ static void packet_recv(connection_t* connection)
 
 		packet_read_entities(connection, &packet->data[sizeof(header)], packet->size - sizeof(header));
 
-		heap_free(net->heap, packet);
+		object_pool_free(net->packet_pool, packet);
 	}
 }
@@ -0,0 +1,97 @@
+#include "object_pool.h"
+
+#include "atomic.h"
+#include "heap.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// The free list head packs a change counter in the upper 32 bits and
+// the index of the first free object plus one in the lower 32 bits.
+// The counter changes on every update, so a stale head can't win a CAS (ABA).
+typedef struct object_pool_t
+{
+	heap_t* heap;
+	char* objects;
+	int* next_free;
+	size_t object_size;
+	int count;
+	int64_t free_head;
+} object_pool_t;
+
+object_pool_t* object_pool_create(heap_t* heap, size_t object_size, int count)
+{
+	object_pool_t* pool = heap_alloc(heap, sizeof(object_pool_t), 8);
+	pool->heap = heap;
+	pool->object_size = (object_size + 15) & ~(size_t)15;
+	pool->count = count;
+	pool->objects = heap_alloc(heap, pool->object_size * count, 16);
+	pool->next_free = heap_alloc(heap, sizeof(int) * count, 8);
+
+	// Chain every object into the free list in address order.
+	for (int i = 0; i < count; ++i)
+	{
+		pool->next_free[i] = i + 2 <= count ? i + 2 : 0;
+	}
+	pool->free_head = count > 0 ? 1 : 0;
+
+	return pool;
+}
+
+void object_pool_destroy(object_pool_t* pool)
+{
+	heap_free(pool->heap, pool->next_free);
+	heap_free(pool->heap, pool->objects);
+	heap_free(pool->heap, pool);
+}
+
+void* object_pool_alloc(object_pool_t* pool)
+{
+	int64_t head = atomic_load64(&pool->free_head);
+	while (true)
+	{
+		int index = (int)(head & 0xffffffff);
+		if (index == 0)
+		{
+			return heap_alloc(pool->heap, pool->object_size, 16);
+		}
+
+		int64_t new_head = (int64_t)((((uint64_t)head >> 32) + 1) << 32 | (uint32_t)pool->next_free[index - 1]);
+		int64_t old_head = atomic_compare_and_exchange64(&pool->free_head, head, new_head);
+		if (old_head == head)
+		{
+			return pool->objects + pool->object_size * (index - 1);
+		}
+		head = old_head;
+	}
+}
+
+void object_pool_free(object_pool_t* pool, void* object)
+{
+	if (!object)
+	{
+		return;
+	}
+
+	char* address = object;
+	if (address < pool->objects || address >= pool->objects + pool->object_size * pool->count)
+	{
+		heap_free(pool->heap, object);
+		return;
+	}
+
+	int index = (int)((address - pool->objects) / pool->object_size) + 1;
+	int64_t head = atomic_load64(&pool->free_head);
+	while (true)
+	{
+		pool->next_free[index - 1] = (int)(head & 0xffffffff);
+
+		int64_t new_head = (int64_t)((((uint64_t)head >> 32) + 1) << 32 | (uint32_t)index);
+		int64_t old_head = atomic_compare_and_exchange64(&pool->free_head, head, new_head);
+		if (old_head == head)
+		{
+			return;
+		}
+		head = old_head;
+	}
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stddef.h>
+
+// Fixed-size Object Pool
+//
+// Main object, object_pool_t, hands out objects of a single size from a
+// preallocated block. Allocation and free are O(1), lock-free and
+// safe to call from any thread.
+//
+// If the pool runs dry, objects are allocated from the backing heap instead.
+// object_pool_free() handles both kinds of object.
+
+// Handle to an object pool.
+typedef struct object_pool_t object_pool_t;
+
+typedef struct heap_t heap_t;
+
+// Create a pool of count objects of object_size bytes.
+// Objects are 16-byte aligned.
+object_pool_t* object_pool_create(heap_t* heap, size_t object_size, int count);
+
+// Destroy a previously created pool.
+// All objects must have been returned to the pool.
+void object_pool_destroy(object_pool_t* pool);
+
+// Allocate an object from the pool.
+void* object_pool_alloc(object_pool_t* pool);
+
+// Return an object previously allocated from the pool.
+void object_pool_free(object_pool_t* pool, void* object);
@@ -1,63 +1,322 @@
 #include "atomic.h"
 #include "heap.h"
-#include "semaphore.h"
+#include "queue.h"
 
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+#pragma comment(lib, "Synchronization.lib")
+
+enum
+{
+	k_queue_cache_line = 64,
+
+	// Attempts before a blocked push or pop parks in the kernel.
+	k_queue_spin_count = 64,
+
+	// Items popped per step by queue_drain.
+	k_queue_drain_batch = 64,
+};
+
+// A slot in the ring.
+// The sequence number says whether the slot is ready to be written (== position)
+// or read (== position + 1) by the operation that claimed that position.
+typedef struct queue_cell_t
+{
+	int sequence;
+	void* item;
+} queue_cell_t;
+
+// Bounded multi-producer/multi-consumer ring after Dmitry Vyukov.
+// Each group of fields written by a different party sits on its own cache line.
 typedef struct queue_t
 {
 	heap_t* heap;
-	semaphore_t* used_items;
-	semaphore_t* free_items;
-	void** items;
-	int capacity;
-	int head_index;
+	queue_cell_t* cells;
+	int mask;
+	char pad0[k_queue_cache_line];
+
+	// Next position to push.
 	int tail_index;
+	char pad1[k_queue_cache_line - sizeof(int)];
+
+	// Next position to pop.
+	int head_index;
+	char pad2[k_queue_cache_line - sizeof(int)];
+
+	// Blocked poppers wait for items_epoch to change; pushers only bump it when someone waits.
+	int items_epoch;
+	int pop_waiters;
+	char pad3[k_queue_cache_line - 2 * sizeof(int)];
+
+	// Blocked pushers wait for space_epoch to change.
+	int space_epoch;
+	int push_waiters;
+	char pad4[k_queue_cache_line - 2 * sizeof(int)];
 } queue_t;
 
 queue_t* queue_create(heap_t* heap, int capacity)
 {
-	queue_t* queue = heap_alloc(heap, sizeof(queue_t), 8);
-	queue->items = heap_alloc(heap, sizeof(void*) * capacity, 8);
-	queue->used_items = semaphore_create(0, capacity);
-	queue->free_items = semaphore_create(capacity, capacity);
+	int size = 1;
+	while (size < capacity)
+	{
+		size <<= 1;
+	}
+
+	queue_t* queue = heap_alloc(heap, sizeof(queue_t), k_queue_cache_line);
+	queue->cells = heap_alloc(heap, sizeof(queue_cell_t) * size, k_queue_cache_line);
+	for (int i = 0; i < size; ++i)
+	{
+		queue->cells[i].sequence = i;
+		queue->cells[i].item = NULL;
+	}
 	queue->heap = heap;
-	queue->capacity = capacity;
-	queue->head_index = 0;
+	queue->mask = size - 1;
 	queue->tail_index = 0;
+	queue->head_index = 0;
+	queue->items_epoch = 0;
+	queue->pop_waiters = 0;
+	queue->space_epoch = 0;
+	queue->push_waiters = 0;
 	return queue;
 }
 
 void queue_destroy(queue_t* queue)
 {
-	semaphore_destroy(queue->used_items);
-	semaphore_destroy(queue->free_items);
-	heap_free(queue->heap, queue->items);
+	heap_free(queue->heap, queue->cells);
 	heap_free(queue->heap, queue);
 }
 
+// Wake threads parked on an epoch, if there are any.
+static void queue_wake(int* epoch, int* waiters)
+{
+	if (atomic_load(waiters))
+	{
+		atomic_increment(epoch);
+		WakeByAddressAll(epoch);
+	}
+}
+
+// Block until the epoch moves past the given value.
+// The waiter count must be raised before the caller's last attempt,
+// so an operation that completes after that attempt sees it and wakes us.
+static void queue_park(int* epoch, int observed_epoch)
+{
+	WaitOnAddress(epoch, &observed_epoch, sizeof(observed_epoch), INFINITE);
+}
+
+// Claim up to count consecutive positions with one compare-and-swap and fill them.
+// Returns the number of items pushed; zero if the queue is full.
+static int queue_try_push_n_internal(queue_t* queue, void** items, int count)
+{
+	int position = atomic_load_explicit(&queue->tail_index, k_atomic_relaxed);
+	int claimed;
+	while (true)
+	{
+		// A cell ready for a position stays ready until that position is claimed,
+		// so cells counted here are still ready if the compare-and-swap succeeds.
+		claimed = 0;
+		while (claimed < count &&
+			atomic_load(&queue->cells[(position + claimed) & queue->mask].sequence) == position + claimed)
+		{
+			++claimed;
+		}
+
+		if (claimed)
+		{
+			int old_position = atomic_compare_and_exchange(&queue->tail_index, position, position + claimed);
+			if (old_position == position)
+			{
+				break;
+			}
+			position = old_position;
+		}
+		else if ((int)((unsigned)atomic_load(&queue->cells[position & queue->mask].sequence) - (unsigned)position) < 0)
+		{
+			// The slot still holds the item from one lap ago: the queue is full.
+			return 0;
+		}
+		else
+		{
+			position = atomic_load_explicit(&queue->tail_index, k_atomic_relaxed);
+		}
+	}
+
+	for (int i = 0; i < claimed; ++i)
+	{
+		queue_cell_t* cell = &queue->cells[(position + i) & queue->mask];
+		cell->item = items[i];
+		if (i + 1 < claimed)
+		{
+			atomic_store(&cell->sequence, position + i + 1);
+		}
+		else
+		{
+			// Full barrier: publishes the items before the waiter count is read in queue_wake.
+			atomic_exchange(&cell->sequence, position + i + 1);
+		}
+	}
+	return claimed;
+}
+
+// Claim up to count consecutive filled positions with one compare-and-swap and empty them.
+// Returns the number of items popped; zero if the queue is empty.
+static int queue_try_pop_n_internal(queue_t* queue, void** items, int count)
+{
+	int position = atomic_load_explicit(&queue->head_index, k_atomic_relaxed);
+	int claimed;
+	while (true)
+	{
+		claimed = 0;
+		while (claimed < count &&
+			atomic_load(&queue->cells[(position + claimed) & queue->mask].sequence) == position + claimed + 1)
+		{
+			++claimed;
+		}
+
+		if (claimed)
+		{
+			int old_position = atomic_compare_and_exchange(&queue->head_index, position, position + claimed);
+			if (old_position == position)
+			{
+				break;
+			}
+			position = old_position;
+		}
+		else if ((int)((unsigned)atomic_load(&queue->cells[position & queue->mask].sequence) - (unsigned)(position + 1)) < 0)
+		{
+			// Nothing has been pushed to this slot yet: the queue is empty.
+			return 0;
+		}
+		else
+		{
+			position = atomic_load_explicit(&queue->head_index, k_atomic_relaxed);
+		}
+	}
+
+	for (int i = 0; i < claimed; ++i)
+	{
+		queue_cell_t* cell = &queue->cells[(position + i) & queue->mask];
+		items[i] = cell->item;
+		if (i + 1 < claimed)
+		{
+			atomic_store(&cell->sequence, position + i + queue->mask + 1);
+		}
+		else
+		{
+			atomic_exchange(&cell->sequence, position + i + queue->mask + 1);
+		}
+	}
+	return claimed;
+}
+
+void queue_push_n(queue_t* queue, void** items, int count)
+{
+	int spins = 0;
+	while (count > 0)
+	{
+		int pushed = queue_try_push_n_internal(queue, items, count);
+		if (!pushed && spins < k_queue_spin_count)
+		{
+			++spins;
+			YieldProcessor();
+			continue;
+		}
+		if (!pushed)
+		{
+			int epoch = atomic_load(&queue->space_epoch);
+			atomic_increment(&queue->push_waiters);
+			pushed = queue_try_push_n_internal(queue, items, count);
+			if (!pushed)
+			{
+				queue_park(&queue->space_epoch, epoch);
+			}
+			atomic_decrement(&queue->push_waiters);
+		}
+		if (pushed)
+		{
+			queue_wake(&queue->items_epoch, &queue->pop_waiters);
+			items += pushed;
+			count -= pushed;
+			spins = 0;
+		}
+	}
+}
+
+int queue_pop_n(queue_t* queue, void** items, int capacity)
+{
+	int spins = 0;
+	while (true)
+	{
+		int popped = queue_try_pop_n_internal(queue, items, capacity);
+		if (!popped && spins < k_queue_spin_count)
+		{
+			++spins;
+			YieldProcessor();
+			continue;
+		}
+		if (!popped)
+		{
+			int epoch = atomic_load(&queue->items_epoch);
+			atomic_increment(&queue->pop_waiters);
+			popped = queue_try_pop_n_internal(queue, items, capacity);
+			if (!popped)
+			{
+				queue_park(&queue->items_epoch, epoch);
+			}
+			atomic_decrement(&queue->pop_waiters);
+		}
+		if (popped)
+		{
+			queue_wake(&queue->space_epoch, &queue->push_waiters);
+			return popped;
+		}
+	}
+}
+
+int queue_try_pop_n(queue_t* queue, void** items, int capacity)
+{
+	int popped = queue_try_pop_n_internal(queue, items, capacity);
+	if (popped)
+	{
+		queue_wake(&queue->space_epoch, &queue->push_waiters);
+	}
+	return popped;
+}
+
+int queue_drain(queue_t* queue, queue_drain_func_t func, void* user)
+{
+	void* items[k_queue_drain_batch];
+	int total = 0;
+	int popped;
+	while ((popped = queue_try_pop_n(queue, items, k_queue_drain_batch)) > 0)
+	{
+		for (int i = 0; i < popped; ++i)
+		{
+			func(items[i], user);
+		}
+		total += popped;
+	}
+	return total;
+}
+
 void queue_push(queue_t* queue, void* item)
 {
-	semaphore_acquire(queue->free_items);
-	int index = atomic_increment(&queue->tail_index) % queue->capacity;
-	queue->items[index] = item;
-	semaphore_release(queue->used_items);
+	queue_push_n(queue, &item, 1);
 }
 
 void* queue_pop(queue_t* queue)
 {
-	semaphore_acquire(queue->used_items);
-	int index = atomic_increment(&queue->head_index) % queue->capacity;
-	void* item = queue->items[index];
-	semaphore_release(queue->free_items);
+	void* item;
+	queue_pop_n(queue, &item, 1);
 	return item;
 }
 
 bool queue_try_push(queue_t* queue, void* item)
 {
-	if (semaphore_try_acquire(queue->free_items))
+	if (queue_try_push_n_internal(queue, &item, 1))
 	{
-		int index = atomic_increment(&queue->tail_index) % queue->capacity;
-		queue->items[index] = item;
-		semaphore_release(queue->used_items);
+		queue_wake(&queue->items_epoch, &queue->pop_waiters);
 		return true;
 	}
 	return false;
@@ -65,12 +324,6 @@ bool queue_try_push(queue_t* queue, void* item)
 
 void* queue_try_pop(queue_t* queue)
 {
-	if (semaphore_try_acquire(queue->used_items))
-	{
-		int index = atomic_increment(&queue->head_index) % queue->capacity;
-		void* item = queue->items[index];
-		semaphore_release(queue->free_items);
-		return item;
-	}
-	return NULL;
+	void* item;
+	return queue_try_pop_n(queue, &item, 1) ? item : NULL;
 }
@@ -3,6 +3,9 @@
 #include <stdbool.h>
 
 // Thread-safe Queue container
+//
+// A lock-free ring buffer. Pushes and pops only enter the kernel when
+// they have to wait for a full or empty queue.
 
 // Handle to a thread-safe queue.
 typedef struct queue_t queue_t;
@@ -10,6 +13,7 @@ typedef struct queue_t queue_t;
 typedef struct heap_t heap_t;
 
 // Create a queue with the defined capacity.
+// Capacity is rounded up to a power of two.
 queue_t* queue_create(heap_t* heap, int capacity);
 
 // Destroy a previously created queue.
@@ -34,3 +38,26 @@ bool queue_try_push(queue_t* queue, void* item);
 // If the queue is empty, returns NULL.
 // Safe for multiple threads to pop at the same time.
 void* queue_try_pop(queue_t* queue);
+
+// Push several items onto a queue in order.
+// Claims as many slots as are free in one step and wakes consumers once per step.
+// If the queue fills up, blocks until all items are pushed.
+// Items from concurrent pushers may interleave between steps.
+void queue_push_n(queue_t* queue, void** items, int count);
+
+// Pop up to capacity items off a queue (FIFO order) in one step.
+// If the queue is empty, blocks until at least one item is available.
+// Returns the number of items popped.
+int queue_pop_n(queue_t* queue, void** items, int capacity);
+
+// Pop up to capacity items off a queue (FIFO order) in one step.
+// Returns the number of items popped; zero if the queue is empty.
+int queue_try_pop_n(queue_t* queue, void** items, int capacity);
+
+// Callback for queue_drain.
+typedef void (*queue_drain_func_t)(void* item, void* user);
+
+// Pop every item currently in a queue, in batches, and pass each to func.
+// Returns once the queue is empty; never blocks.
+// Returns the number of items drained.
+int queue_drain(queue_t* queue, queue_drain_func_t func, void* user);
@@ -0,0 +1,228 @@
+#include "atomic.h"
+#include "heap.h"
+#include "queue_spsc.h"
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+#pragma comment(lib, "Synchronization.lib")
+
+enum
+{
+	k_queue_spsc_cache_line = 64,
+
+	// Attempts before a blocked push or pop parks in the kernel.
+	k_queue_spsc_spin_count = 64,
+
+	// Items popped per step by queue_spsc_drain.
+	k_queue_spsc_drain_batch = 64,
+};
+
+typedef struct queue_spsc_t
+{
+	heap_t* heap;
+	void** items;
+	int mask;
+	char pad0[k_queue_spsc_cache_line];
+
+	// Written by the producer. It re-reads head_index only when its cached copy says the queue is full.
+	int tail_index;
+	int cached_head_index;
+	char pad1[k_queue_spsc_cache_line - 2 * sizeof(int)];
+
+	// Written by the consumer. It re-reads tail_index only when its cached copy says the queue is empty.
+	int head_index;
+	int cached_tail_index;
+	char pad2[k_queue_spsc_cache_line - 2 * sizeof(int)];
+
+	// Set while a side is parked, so the other side knows to wake it.
+	// Each side stores its index, fences, then reads the other's flag; a parking side sets
+	// its flag with a full barrier, then re-reads the index. One of the two always sees the other.
+	int pop_waiting;
+	char pad3[k_queue_spsc_cache_line - sizeof(int)];
+	int push_waiting;
+	char pad4[k_queue_spsc_cache_line - sizeof(int)];
+} queue_spsc_t;
+
+queue_spsc_t* queue_spsc_create(heap_t* heap, int capacity)
+{
+	int size = 1;
+	while (size < capacity)
+	{
+		size <<= 1;
+	}
+
+	queue_spsc_t* queue = heap_alloc(heap, sizeof(queue_spsc_t), k_queue_spsc_cache_line);
+	queue->items = heap_alloc(heap, sizeof(void*) * size, k_queue_spsc_cache_line);
+	queue->heap = heap;
+	queue->mask = size - 1;
+	queue->tail_index = 0;
+	queue->cached_head_index = 0;
+	queue->head_index = 0;
+	queue->cached_tail_index = 0;
+	queue->pop_waiting = 0;
+	queue->push_waiting = 0;
+	return queue;
+}
+
+void queue_spsc_destroy(queue_spsc_t* queue)
+{
+	heap_free(queue->heap, queue->items);
+	heap_free(queue->heap, queue);
+}
+
+// Push as many items as fit, publishing them with a single index store.
+static int queue_spsc_try_push_n_internal(queue_spsc_t* queue, void** items, int count)
+{
+	int tail = queue->tail_index;
+	int free_count = queue->mask + 1 - (tail - queue->cached_head_index);
+	if (free_count < count)
+	{
+		queue->cached_head_index = atomic_load(&queue->head_index);
+		free_count = queue->mask + 1 - (tail - queue->cached_head_index);
+	}
+
+	int pushed = __min(count, free_count);
+	for (int i = 0; i < pushed; ++i)
+	{
+		queue->items[(tail + i) & queue->mask] = items[i];
+	}
+	if (pushed)
+	{
+		atomic_store(&queue->tail_index, tail + pushed);
+		// Full barrier: the new tail must be visible before pop_waiting is read.
+		atomic_fence(k_atomic_seq_cst);
+		if (atomic_load(&queue->pop_waiting))
+		{
+			WakeByAddressSingle(&queue->tail_index);
+		}
+	}
+	return pushed;
+}
+
+int queue_spsc_try_pop_n(queue_spsc_t* queue, void** items, int capacity)
+{
+	int head = queue->head_index;
+	int available = queue->cached_tail_index - head;
+	if (available < capacity)
+	{
+		queue->cached_tail_index = atomic_load(&queue->tail_index);
+		available = queue->cached_tail_index - head;
+	}
+
+	int popped = __min(capacity, available);
+	for (int i = 0; i < popped; ++i)
+	{
+		items[i] = queue->items[(head + i) & queue->mask];
+	}
+	if (popped)
+	{
+		atomic_store(&queue->head_index, head + popped);
+		// Full barrier: the new head must be visible before push_waiting is read.
+		atomic_fence(k_atomic_seq_cst);
+		if (atomic_load(&queue->push_waiting))
+		{
+			WakeByAddressSingle(&queue->head_index);
+		}
+	}
+	return popped;
+}
+
+void queue_spsc_push_n(queue_spsc_t* queue, void** items, int count)
+{
+	int spins = 0;
+	while (count > 0)
+	{
+		int pushed = queue_spsc_try_push_n_internal(queue, items, count);
+		items += pushed;
+		count -= pushed;
+		if (pushed || count == 0)
+		{
+			spins = 0;
+			continue;
+		}
+
+		if (spins < k_queue_spsc_spin_count)
+		{
+			++spins;
+			YieldProcessor();
+			continue;
+		}
+
+		// Full means head is exactly one lap behind tail; sleep until head moves.
+		atomic_exchange(&queue->push_waiting, 1);
+		int full_head = queue->tail_index - queue->mask - 1;
+		if (atomic_load(&queue->head_index) == full_head)
+		{
+			WaitOnAddress(&queue->head_index, &full_head, sizeof(full_head), INFINITE);
+		}
+		atomic_store(&queue->push_waiting, 0);
+	}
+}
+
+int queue_spsc_pop_n(queue_spsc_t* queue, void** items, int capacity)
+{
+	int spins = 0;
+	while (true)
+	{
+		int popped = queue_spsc_try_pop_n(queue, items, capacity);
+		if (popped)
+		{
+			return popped;
+		}
+
+		if (spins < k_queue_spsc_spin_count)
+		{
+			++spins;
+			YieldProcessor();
+			continue;
+		}
+
+		atomic_exchange(&queue->pop_waiting, 1);
+		int head = queue->head_index;
+		if (atomic_load(&queue->tail_index) == head)
+		{
+			WaitOnAddress(&queue->tail_index, &head, sizeof(head), INFINITE);
+		}
+		atomic_store(&queue->pop_waiting, 0);
+	}
+}
+
+int queue_spsc_drain(queue_spsc_t* queue, queue_spsc_drain_func_t func, void* user)
+{
+	void* items[k_queue_spsc_drain_batch];
+	int total = 0;
+	int popped;
+	while ((popped = queue_spsc_try_pop_n(queue, items, k_queue_spsc_drain_batch)) > 0)
+	{
+		for (int i = 0; i < popped; ++i)
+		{
+			func(items[i], user);
+		}
+		total += popped;
+	}
+	return total;
+}
+
+bool queue_spsc_try_push(queue_spsc_t* queue, void* item)
+{
+	return queue_spsc_try_push_n_internal(queue, &item, 1) == 1;
+}
+
+void* queue_spsc_try_pop(queue_spsc_t* queue)
+{
+	void* item;
+	return queue_spsc_try_pop_n(queue, &item, 1) ? item : NULL;
+}
+
+void queue_spsc_push(queue_spsc_t* queue, void* item)
+{
+	queue_spsc_push_n(queue, &item, 1);
+}
+
+void* queue_spsc_pop(queue_spsc_t* queue)
+{
+	void* item;
+	queue_spsc_pop_n(queue, &item, 1);
+	return item;
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <stdbool.h>
+
+// Single-producer/single-consumer queue container
+//
+// A ring buffer for handing items from exactly one thread to exactly one
+// other thread. Faster than queue_t: pushes and pops need no read-modify-write,
+// only a fence per publish, and each side keeps its own index on its own cache line.
+// Blocking calls spin briefly and then park until the other side moves.
+
+// Handle to a single-producer/single-consumer queue.
+typedef struct queue_spsc_t queue_spsc_t;
+
+typedef struct heap_t heap_t;
+
+// Create a queue with the defined capacity.
+// Capacity is rounded up to a power of two.
+queue_spsc_t* queue_spsc_create(heap_t* heap, int capacity);
+
+// Destroy a previously created queue.
+void queue_spsc_destroy(queue_spsc_t* queue);
+
+// Push an item onto a queue.
+// If the queue is full, blocks until space is available.
+// Only one thread may push to a queue.
+void queue_spsc_push(queue_spsc_t* queue, void* item);
+
+// Pop an item off a queue (FIFO order).
+// If the queue is empty, blocks until an item is available.
+// Only one thread may pop from a queue.
+void* queue_spsc_pop(queue_spsc_t* queue);
+
+// Push an item onto a queue if space is available.
+// If the queue is full, returns false.
+bool queue_spsc_try_push(queue_spsc_t* queue, void* item);
+
+// Pop an item off a queue (FIFO order).
+// If the queue is empty, returns NULL.
+void* queue_spsc_try_pop(queue_spsc_t* queue);
+
+// Push several items onto a queue in order, publishing each run that fits at once.
+// If the queue fills up, blocks until all items are pushed.
+void queue_spsc_push_n(queue_spsc_t* queue, void** items, int count);
+
+// Pop up to capacity items off a queue (FIFO order) at once.
+// If the queue is empty, blocks until at least one item is available.
+// Returns the number of items popped.
+int queue_spsc_pop_n(queue_spsc_t* queue, void** items, int capacity);
+
+// Pop up to capacity items off a queue (FIFO order) at once.
+// Returns the number of items popped; zero if the queue is empty.
+int queue_spsc_try_pop_n(queue_spsc_t* queue, void** items, int capacity);
+
+// Callback for queue_spsc_drain.
+typedef void (*queue_spsc_drain_func_t)(void* item, void* user);
+
+// Pop every item currently in a queue, in batches, and pass each to func.
+// Returns once the queue is empty; never blocks.
+// Returns the number of items drained.
+int queue_spsc_drain(queue_spsc_t* queue, queue_spsc_drain_func_t func, void* user);
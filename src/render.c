@@ -1,9 +1,11 @@
 #include "render.h"
 
+#include "debug.h"
 #include "ecs.h"
+#include "frame_heap.h"
 #include "gpu.h"
 #include "heap.h"
-#include "queue.h"
+#include "queue_spsc.h"
 #include "thread.h"
 #include "wm.h"
 
@@ -13,6 +15,20 @@
 enum
 {
 	k_render_max_drawables = 512,
+
+	// Commands and uniform copies for one frame come from a frame heap,
+	// sized for k_render_max_drawables models with uniforms of up to this many bytes.
+	// Triple buffered so the game can run up to three frames ahead of the render thread.
+	k_render_frame_heap_count = 3,
+	k_render_max_uniform_size = 256,
+
+	// Render state, GPU objects and frame heaps come from a child heap of this size.
+	k_render_heap_budget = 8 * 1024 * 1024,
+
+	// Commands are handed to the render thread in batches of this many.
+	k_render_command_batch = 64,
+	// Enough for every frame the frame heaps allow the game to run ahead.
+	k_render_queue_capacity = 1024,
 };
 
 typedef enum command_type_t
@@ -64,7 +80,17 @@ typedef struct render_t
 	wm_window_t* window;
 	thread_t* thread;
 	gpu_t* gpu;
-	queue_t* queue;
+	queue_spsc_t* queue;
+
+	frame_heap_t* frame_heap;
+	bool frame_begun;
+	// Set once a model has been dropped this frame, so the warning prints once per frame.
+	bool frame_dropped;
+	frame_done_command_t frame_done_command;
+
+	// Commands recorded by the game thread but not yet pushed to the render thread.
+	void* pending_commands[k_render_command_batch];
+	int pending_count;
 
 	int frame_counter;
 	int gpu_frame_count;
@@ -78,6 +104,8 @@ typedef struct render_t
 } render_t;
 
 static int render_thread_func(void* user);
+static void render_push_command(render_t* render, void* command);
+static void render_flush_commands(render_t* render);
 static draw_shader_t* create_or_get_shader_for_model_command(render_t* render, model_command_t* command);
 static draw_mesh_t* create_or_get_mesh_for_model_command(render_t* render, model_command_t* command);
 static draw_instance_t* create_or_get_instance_for_model_command(render_t* render, model_command_t* command, gpu_shader_t* shader);
@@ -85,44 +113,95 @@ static void destroy_stale_data(render_t* render);
 
 render_t* render_create(heap_t* heap, wm_window_t* window)
 {
-	render_t* render = heap_alloc(heap, sizeof(render_t), 8);
+	heap = heap_create_child(heap, k_render_heap_budget, k_heap_tag_render, NULL, NULL);
+	render_t* render = heap_alloc_tagged(heap, sizeof(render_t), 8, k_heap_tag_render);
 	render->heap = heap;
 	render->window = window;
-	render->queue = queue_create(heap, 3);
+	render->queue = queue_spsc_create(heap, k_render_queue_capacity);
+	size_t frame_size = k_render_max_drawables * (sizeof(model_command_t) + k_render_max_uniform_size);
+	render->frame_heap = frame_heap_create(heap, frame_size, k_render_frame_heap_count);
+	render->frame_done_command.type = k_command_frame_done;
+	render->frame_begun = false;
+	render->frame_dropped = false;
+	render->pending_count = 0;
 	render->frame_counter = 0;
 	render->instance_count = 0;
 	render->mesh_count = 0;
 	render->shader_count = 0;
-	render->thread = thread_create(render_thread_func, render);
+	render->thread = thread_create_ex(render_thread_func, render, &(thread_options_t) { .name = "render", .priority = k_thread_priority_high });
 	return render;
 }
 
 void render_destroy(render_t* render)
 {
-	queue_push(render->queue, NULL);
+	render_push_command(render, NULL);
+	render_flush_commands(render);
 	thread_destroy(render->thread);
-	queue_destroy(render->queue);
-	heap_free(render->heap, render);
+	queue_spsc_destroy(render->queue);
+	frame_heap_destroy(render->frame_heap);
+	heap_t* heap = render->heap;
+	heap_free(heap, render);
+	heap_destroy(heap);
 }
 
 void render_push_model(render_t* render, ecs_entity_ref_t* entity, gpu_mesh_info_t* mesh, gpu_shader_info_t* shader, gpu_uniform_buffer_info_t* uniform)
 {
-	model_command_t* command = heap_alloc(render->heap, sizeof(model_command_t), 8);
+	if (!render->frame_begun)
+	{
+		frame_heap_begin(render->frame_heap);
+		render->frame_begun = true;
+	}
+
+	model_command_t* command = frame_heap_alloc(render->frame_heap, sizeof(model_command_t), 8);
+	void* uniform_data = frame_heap_alloc(render->frame_heap, uniform->size, 8);
+	if (!command || !uniform_data)
+	{
+		if (!render->frame_dropped)
+		{
+			debug_print(k_print_warning, "Frame heap full, dropping models for the rest of the frame.\n");
+			render->frame_dropped = true;
+		}
+		return;
+	}
 	command->type = k_command_model;
 	command->entity = *entity;
 	command->mesh = mesh;
 	command->shader = shader;
 	command->uniform_buffer.size = uniform->size;
-	command->uniform_buffer.data = heap_alloc(render->heap, uniform->size, 8);
+	command->uniform_buffer.data = uniform_data;
 	memcpy(command->uniform_buffer.data, uniform->data, uniform->size);
-	queue_push(render->queue, command);
+	render_push_command(render, command);
 }
 
 void render_push_done(render_t* render)
 {
-	frame_done_command_t* command = heap_alloc(render->heap, sizeof(frame_done_command_t), 8);
-	command->type = k_command_frame_done;
-	queue_push(render->queue, command);
+	if (!render->frame_begun)
+	{
+		frame_heap_begin(render->frame_heap);
+	}
+	render->frame_begun = false;
+	render->frame_dropped = false;
+
+	// The end-of-frame marker carries no data, so every frame shares one.
+	render_push_command(render, &render->frame_done_command);
+	render_flush_commands(render);
+}
+
+// Record a command, handing a full batch to the render thread.
+static void render_push_command(render_t* render, void* command)
+{
+	render->pending_commands[render->pending_count++] = command;
+	if (render->pending_count == k_render_command_batch)
+	{
+		render_flush_commands(render);
+	}
+}
+
+// Hand all recorded commands to the render thread at once.
+static void render_flush_commands(render_t* render)
+{
+	queue_spsc_push_n(render->queue, render->pending_commands, render->pending_count);
+	render->pending_count = 0;
 }
 
 static int render_thread_func(void* user)
@@ -137,9 +216,20 @@ static int render_thread_func(void* user)
 	gpu_mesh_t* last_mesh = NULL;
 	int frame_index = 0;
 
+	void* commands[k_render_command_batch];
+	int command_count = 0;
+	int command_index = 0;
+
 	while (true)
 	{
-		command_type_t* type = queue_pop(render->queue);
+		// Take everything the game thread has handed over, up to a batch, in one step.
+		if (command_index == command_count)
+		{
+			command_count = queue_spsc_pop_n(render->queue, commands, _countof(commands));
+			command_index = 0;
+		}
+
+		command_type_t* type = commands[command_index++];
 		if (!type)
 		{
 			break;
@@ -160,6 +250,9 @@ static int render_thread_func(void* user)
 			destroy_stale_data(render);
 			++render->frame_counter;
 			frame_index = render->frame_counter % render->gpu_frame_count;
+
+			// Done with every command of this frame, release its memory.
+			frame_heap_retire(render->frame_heap);
 		}
 		else if (*type == k_command_model)
 		{
@@ -168,8 +261,6 @@ static int render_thread_func(void* user)
 			draw_mesh_t* mesh = create_or_get_mesh_for_model_command(render, command);
 			draw_instance_t* instance = create_or_get_instance_for_model_command(render, command, shader->shader);
 
-			heap_free(render->heap, command->uniform_buffer.data);
-
 			if (last_pipeline != shader->pipeline)
 			{
 				gpu_cmd_pipeline_bind(render->gpu, cmdbuf, shader->pipeline);
@@ -183,8 +274,6 @@ static int render_thread_func(void* user)
 			gpu_cmd_descriptor_bind(render->gpu, cmdbuf, instance->descriptors[frame_index]);
 			gpu_cmd_draw(render->gpu, cmdbuf);
 		}
-
-		heap_free(render->heap, type);
 	}
 
 	gpu_wait_until_idle(render->gpu);
@@ -273,8 +362,8 @@ static draw_instance_t* create_or_get_instance_for_model_command(render_t* rende
 		instance = &render->instances[render->instance_count++];
 
 		instance->entity = command->entity;
-		instance->uniform_buffers = heap_alloc(render->heap, sizeof(gpu_uniform_buffer_t*) * render->gpu_frame_count, 8);
-		instance->descriptors = heap_alloc(render->heap, sizeof(gpu_descriptor_t*) * render->gpu_frame_count, 8);
+		instance->uniform_buffers = heap_alloc_tagged(render->heap, sizeof(gpu_uniform_buffer_t*) * render->gpu_frame_count, 8, k_heap_tag_render);
+		instance->descriptors = heap_alloc_tagged(render->heap, sizeof(gpu_descriptor_t*) * render->gpu_frame_count, 8, k_heap_tag_render);
 		for (int i = 0; i < render->gpu_frame_count; ++i)
 		{
 			instance->uniform_buffers[i] = gpu_uniform_buffer_create(render->gpu, &command->uniform_buffer);
@@ -0,0 +1,55 @@
+#include "rwlock.h"
+
+#include "heap.h"
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+typedef struct rwlock_t
+{
+	heap_t* heap;
+	SRWLOCK lock;
+} rwlock_t;
+
+rwlock_t* rwlock_create(heap_t* heap)
+{
+	rwlock_t* lock = heap_alloc(heap, sizeof(rwlock_t), 8);
+	lock->heap = heap;
+	InitializeSRWLock(&lock->lock);
+	return lock;
+}
+
+void rwlock_destroy(rwlock_t* lock)
+{
+	heap_free(lock->heap, lock);
+}
+
+void rwlock_lock_read(rwlock_t* lock)
+{
+	AcquireSRWLockShared(&lock->lock);
+}
+
+bool rwlock_try_lock_read(rwlock_t* lock)
+{
+	return TryAcquireSRWLockShared(&lock->lock) != 0;
+}
+
+void rwlock_unlock_read(rwlock_t* lock)
+{
+	ReleaseSRWLockShared(&lock->lock);
+}
+
+void rwlock_lock_write(rwlock_t* lock)
+{
+	AcquireSRWLockExclusive(&lock->lock);
+}
+
+bool rwlock_try_lock_write(rwlock_t* lock)
+{
+	return TryAcquireSRWLockExclusive(&lock->lock) != 0;
+}
+
+void rwlock_unlock_write(rwlock_t* lock)
+{
+	ReleaseSRWLockExclusive(&lock->lock);
+}
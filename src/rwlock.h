@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stdbool.h>
+
+// Reader-writer lock thread synchronization
+//
+// Any number of threads may hold the lock for reading at once; a writer holds
+// it alone. Uncontended locking is a single atomic operation; waiting threads
+// sleep until the lock is released. Unlike mutex_t, the lock is not recursive.
+
+// Handle to a reader-writer lock.
+typedef struct rwlock_t rwlock_t;
+
+typedef struct heap_t heap_t;
+
+// Creates a new reader-writer lock.
+rwlock_t* rwlock_create(heap_t* heap);
+
+// Destroys a previously created reader-writer lock.
+void rwlock_destroy(rwlock_t* lock);
+
+// Locks for reading. Blocks while a writer holds the lock.
+void rwlock_lock_read(rwlock_t* lock);
+
+// Locks for reading if no writer holds the lock, without blocking.
+// Returns true if the lock was taken; it must then be unlocked.
+bool rwlock_try_lock_read(rwlock_t* lock);
+
+// Releases a read lock.
+void rwlock_unlock_read(rwlock_t* lock);
+
+// Locks for writing. Blocks while any other thread holds the lock.
+void rwlock_lock_write(rwlock_t* lock);
+
+// Locks for writing if no other thread holds the lock, without blocking.
+// Returns true if the lock was taken; it must then be unlocked.
+bool rwlock_try_lock_write(rwlock_t* lock);
+
+// Releases a write lock.
+void rwlock_unlock_write(rwlock_t* lock);
@@ -1,31 +1,125 @@
 #include "semaphore.h"
 
+#include "heap.h"
+#include "lock_profile.h"
+#include "timer.h"
+
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
 
-semaphore_t* semaphore_create(int initial_count, int max_count)
+#pragma comment(lib, "Synchronization.lib")
+
+enum
+{
+	// Spins before an acquirer parks.
+	k_semaphore_spin_count = 64,
+};
+
+typedef struct semaphore_t
 {
-	HANDLE semaphore = CreateSemaphore(NULL, initial_count, max_count, NULL);
-	return (semaphore_t*)semaphore;
+	heap_t* heap;
+	LONG count;
+	LONG max_count;
+	// Threads parked or about to park on count.
+	LONG waiters;
+	// Statistics for a named semaphore.
+	lock_profile_t* profile;
+} semaphore_t;
+
+semaphore_t* semaphore_create(heap_t* heap, int initial_count, int max_count)
+{
+	semaphore_t* semaphore = heap_alloc(heap, sizeof(semaphore_t), 8);
+	semaphore->heap = heap;
+	semaphore->count = initial_count;
+	semaphore->max_count = max_count;
+	semaphore->waiters = 0;
+	semaphore->profile = NULL;
+	return semaphore;
 }
 
 void semaphore_destroy(semaphore_t* semaphore)
 {
-	CloseHandle(semaphore);
+	heap_free(semaphore->heap, semaphore);
+}
+
+void semaphore_set_name(semaphore_t* semaphore, const char* name)
+{
+	semaphore->profile = lock_profile_get(name);
+}
+
+static void semaphore_acquire_contended(semaphore_t* semaphore)
+{
+	for (int spins = 0; spins < k_semaphore_spin_count; ++spins)
+	{
+		YieldProcessor();
+		if (semaphore_try_acquire(semaphore))
+		{
+			return;
+		}
+	}
+
+	// Registering as a waiter before the final check pairs with release
+	// raising the count before checking for waiters, so no wakeup is lost.
+	InterlockedIncrement(&semaphore->waiters);
+	while (!semaphore_try_acquire(semaphore))
+	{
+		LONG zero = 0;
+		WaitOnAddress(&semaphore->count, &zero, sizeof(zero), INFINITE);
+	}
+	InterlockedDecrement(&semaphore->waiters);
 }
 
 void semaphore_acquire(semaphore_t* semaphore)
 {
-	WaitForSingleObject(semaphore, INFINITE);
+	bool contended = !semaphore_try_acquire(semaphore);
+	uint64_t wait_start = 0;
+	if (contended)
+	{
+		wait_start = semaphore->profile ? timer_get_ticks() : 0;
+		semaphore_acquire_contended(semaphore);
+	}
+
+	if (semaphore->profile && lock_profile_is_recording())
+	{
+		lock_profile_acquired(semaphore->profile, contended, wait_start);
+	}
 }
 
 bool semaphore_try_acquire(semaphore_t* semaphore)
 {
-	DWORD result = WaitForSingleObject(semaphore, 0);
-	return result == WAIT_OBJECT_0;
+	LONG count = *(volatile LONG*)&semaphore->count;
+	while (count > 0)
+	{
+		LONG observed = InterlockedCompareExchange(&semaphore->count, count - 1, count);
+		if (observed == count)
+		{
+			return true;
+		}
+		count = observed;
+	}
+	return false;
 }
 
 void semaphore_release(semaphore_t* semaphore)
 {
-	ReleaseSemaphore(semaphore, 1, NULL);
+	// Like ReleaseSemaphore, releasing past the maximum count does nothing.
+	LONG count = *(volatile LONG*)&semaphore->count;
+	while (true)
+	{
+		if (count >= semaphore->max_count)
+		{
+			return;
+		}
+		LONG observed = InterlockedCompareExchange(&semaphore->count, count + 1, count);
+		if (observed == count)
+		{
+			break;
+		}
+		count = observed;
+	}
+
+	if (*(volatile LONG*)&semaphore->waiters)
+	{
+		WakeByAddressSingle(&semaphore->count);
+	}
 }
@@ -3,16 +3,23 @@
 #include <stdbool.h>
 
 // Counting semaphore thread synchronization
+//
+// The count is an atomic integer; only acquiring at zero sleeps.
 
 // Handle to a semaphore.
 typedef struct semaphore_t semaphore_t;
 
+typedef struct heap_t heap_t;
+
 // Creates a new semaphore.
-semaphore_t* semaphore_create(int initial_count, int max_count);
+semaphore_t* semaphore_create(heap_t* heap, int initial_count, int max_count);
 
 // Destroys a previously created semaphore.
 void semaphore_destroy(semaphore_t* semaphore);
 
+// Names a semaphore for lock contention profiling. See lock_profile.h.
+void semaphore_set_name(semaphore_t* semaphore, const char* name);
+
 // Lowers the semaphore count by one.
 // If the semaphore count is zero, blocks until another thread releases.
 void semaphore_acquire(semaphore_t* semaphore);
@@ -0,0 +1,62 @@
+#include "seqlock.h"
+
+#include "atomic.h"
+#include "heap.h"
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+// The sequence is odd while a write is in progress and advances by two per write.
+typedef struct seqlock_t
+{
+	heap_t* heap;
+	int sequence;
+} seqlock_t;
+
+seqlock_t* seqlock_create(heap_t* heap)
+{
+	seqlock_t* lock = heap_alloc(heap, sizeof(seqlock_t), 8);
+	lock->heap = heap;
+	lock->sequence = 0;
+	return lock;
+}
+
+void seqlock_destroy(seqlock_t* lock)
+{
+	heap_free(lock->heap, lock);
+}
+
+int seqlock_read_begin(seqlock_t* lock)
+{
+	int sequence;
+	while ((sequence = atomic_load(&lock->sequence)) & 1)
+	{
+		YieldProcessor();
+	}
+	return sequence;
+}
+
+bool seqlock_read_retry(seqlock_t* lock, int sequence)
+{
+	// The reader's loads of the data must complete before the sequence is checked again.
+	atomic_fence(k_atomic_acquire);
+	return atomic_load_explicit(&lock->sequence, k_atomic_relaxed) != sequence;
+}
+
+void seqlock_write_begin(seqlock_t* lock)
+{
+	while (true)
+	{
+		int sequence = atomic_load_explicit(&lock->sequence, k_atomic_relaxed);
+		if (!(sequence & 1) && atomic_compare_and_exchange(&lock->sequence, sequence, sequence + 1) == sequence)
+		{
+			return;
+		}
+		YieldProcessor();
+	}
+}
+
+void seqlock_write_end(seqlock_t* lock)
+{
+	atomic_store(&lock->sequence, lock->sequence + 1);
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stdbool.h>
+
+// Sequence lock thread synchronization
+//
+// For small, frequently read data that changes rarely. Readers never block
+// writers and never write shared memory; instead they retry if a write
+// happened while they were reading:
+//
+//   int sequence;
+//   do
+//   {
+//     sequence = seqlock_read_begin(lock);
+//     copy = shared_data;
+//   } while (seqlock_read_retry(lock, sequence));
+//
+// A reader may see a half-written copy before it retries, so it should only
+// copy plain values inside the loop and not follow pointers read there.
+// Writers exclude each other.
+
+// Handle to a sequence lock.
+typedef struct seqlock_t seqlock_t;
+
+typedef struct heap_t heap_t;
+
+// Creates a new sequence lock.
+seqlock_t* seqlock_create(heap_t* heap);
+
+// Destroys a previously created sequence lock.
+void seqlock_destroy(seqlock_t* lock);
+
+// Starts a read. Waits out a write in progress.
+// Returns the sequence to pass to seqlock_read_retry.
+int seqlock_read_begin(seqlock_t* lock);
+
+// Ends a read. Returns true if a write overlapped it and the read must be repeated.
+bool seqlock_read_retry(seqlock_t* lock, int sequence);
+
+// Starts a write. Blocks while another writer is active.
+void seqlock_write_begin(seqlock_t* lock);
+
+// Ends a write, making it visible to readers.
+void seqlock_write_end(seqlock_t* lock);
@@ -2,6 +2,7 @@
 #include "fs.h"
 #include "gpu.h"
 #include "heap.h"
+#include "job.h"
 #include "render.h"
 #include "timer_object.h"
 #include "transform.h"
@@ -49,6 +50,7 @@ typedef struct frogger_game_t
 {
 	heap_t* heap;
 	fs_t* fs;
+	job_system_t* jobs;
 	wm_window_t* window;
 	render_t* render;
 
@@ -90,11 +92,12 @@ static void update_players(frogger_game_t* game);
 static void update_obstacles(frogger_game_t* game);
 static void draw_models(frogger_game_t* game);
 
-frogger_game_t* frogger_game_create(heap_t* heap, fs_t* fs, wm_window_t* window, render_t* render)
+frogger_game_t* frogger_game_create(heap_t* heap, fs_t* fs, job_system_t* jobs, wm_window_t* window, render_t* render)
 {
 	frogger_game_t* game = heap_alloc(heap, sizeof(frogger_game_t), 8);
 	game->heap = heap;
 	game->fs = fs;
+	game->jobs = jobs;
 	game->window = window;
 	game->render = render;
 
@@ -399,19 +402,17 @@ static void update_players(frogger_game_t* game)
 	}
 }
 
-// Moves obstacles and deletes when the are past the screen
-void update_obstacles(frogger_game_t* game)
+// Moves one chunk of obstacles and deletes those past the screen.
+// Runs on job threads; removal is deferred to the next ecs_update.
+static void update_obstacles_chunk(ecs_t* ecs, ecs_query_t* query, void* user)
 {
+	frogger_game_t* game = user;
 	float dt = (float)timer_object_get_delta_ms(game->timer) * 0.001f;
 
-	uint64_t k_query_mask = (1ULL << game->transform_type) | (1ULL << game->obstacle_type);
-
-	for (ecs_query_t query = ecs_query_create(game->ecs, k_query_mask);
-		ecs_query_is_valid(game->ecs, &query);
-		ecs_query_next(game->ecs, &query))
+	for (; ecs_query_is_valid(ecs, query); ecs_query_next(ecs, query))
 	{
-		transform_component_t* transform_comp = ecs_query_get_component(game->ecs, &query, game->transform_type);
-		obstacle_component_t* obstacle_comp = ecs_query_get_component(game->ecs, &query, game->obstacle_type);
+		transform_component_t* transform_comp = ecs_query_get_component(ecs, query, game->transform_type);
+		obstacle_component_t* obstacle_comp = ecs_query_get_component(ecs, query, game->obstacle_type);
 
 		transform_t move;
 		transform_identity(&move);
@@ -430,12 +431,19 @@ void update_obstacles(frogger_game_t* game)
 
 		if (transform_comp->transform.translation.y > 9.0f)
 		{
-			ecs_entity_remove(game->ecs, ecs_query_get_entity(game->ecs, &query), false);
+			ecs_entity_remove(ecs, ecs_query_get_entity(ecs, query), false);
 		}
 
 	}
 }
 
+// Moves obstacles and deletes when the are past the screen
+void update_obstacles(frogger_game_t* game)
+{
+	uint64_t k_query_mask = (1ULL << game->transform_type) | (1ULL << game->obstacle_type);
+	ecs_query_for_each_parallel(game->ecs, game->jobs, k_query_mask, 0, update_obstacles_chunk, game);
+}
+
 
 static void draw_models(frogger_game_t* game)
 {
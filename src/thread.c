@@ -5,14 +5,63 @@
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
 
+enum
+{
+	k_thread_max_name = 64,
+};
+
+static void thread_set_name_internal(HANDLE h, const char* name)
+{
+	wchar_t wide_name[k_thread_max_name];
+	if (MultiByteToWideChar(CP_UTF8, 0, name, -1, wide_name, _countof(wide_name)) == 0)
+	{
+		// Too long: keep what fits.
+		wide_name[_countof(wide_name) - 1] = L'\0';
+	}
+	SetThreadDescription(h, wide_name);
+}
+
 thread_t* thread_create(int (*function)(void*), void* data)
+{
+	thread_options_t options = { 0 };
+	return thread_create_ex(function, data, &options);
+}
+
+thread_t* thread_create_ex(int (*function)(void*), void* data, const thread_options_t* options)
 {
 	HANDLE h = CreateThread(NULL, 0, function, data, CREATE_SUSPENDED, NULL);
-	if (h == INVALID_HANDLE_VALUE)
+	if (h == NULL)
 	{
 		debug_print(k_print_warning, "Thread failed to create!\n");
 		return NULL;
 	}
+
+	if (options->name)
+	{
+		thread_set_name_internal(h, options->name);
+	}
+	if (options->affinity_mask && !SetThreadAffinityMask(h, (DWORD_PTR)options->affinity_mask))
+	{
+		debug_print(k_print_warning, "Thread affinity mask %llx not applied.\n", options->affinity_mask);
+	}
+	if (options->priority < k_thread_priority_normal || options->priority > k_thread_priority_time_critical)
+	{
+		debug_print(k_print_warning, "Thread priority %d is out of range.\n", (int)options->priority);
+	}
+	else if (options->priority != k_thread_priority_normal)
+	{
+		static const int k_priorities[] =
+		{
+			[k_thread_priority_normal] = THREAD_PRIORITY_NORMAL,
+			[k_thread_priority_lowest] = THREAD_PRIORITY_LOWEST,
+			[k_thread_priority_low] = THREAD_PRIORITY_BELOW_NORMAL,
+			[k_thread_priority_high] = THREAD_PRIORITY_ABOVE_NORMAL,
+			[k_thread_priority_highest] = THREAD_PRIORITY_HIGHEST,
+			[k_thread_priority_time_critical] = THREAD_PRIORITY_TIME_CRITICAL,
+		};
+		SetThreadPriority(h, k_priorities[options->priority]);
+	}
+
 	ResumeThread(h);
 	return (thread_t*)h;
 }
@@ -26,6 +75,28 @@ int thread_destroy(thread_t* thread)
 	return code;
 }
 
+void thread_set_name(const char* name)
+{
+	thread_set_name_internal(GetCurrentThread(), name);
+}
+
+bool thread_get_name(char* buffer, size_t size)
+{
+	buffer[0] = '\0';
+
+	wchar_t* wide_name = NULL;
+	if (FAILED(GetThreadDescription(GetCurrentThread(), &wide_name)))
+	{
+		return false;
+	}
+	if (WideCharToMultiByte(CP_UTF8, 0, wide_name, -1, buffer, (int)size, NULL, NULL) == 0)
+	{
+		buffer[0] = '\0';
+	}
+	LocalFree(wide_name);
+	return buffer[0] != '\0';
+}
+
 void thread_sleep(uint32_t ms)
 {
 	Sleep(ms);
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 // Threading support.
@@ -7,13 +9,46 @@
 // Handle to a thread.
 typedef struct thread_t thread_t;
 
+// Scheduling priority of a thread, relative to the process.
+typedef enum thread_priority_t
+{
+	k_thread_priority_normal,
+	k_thread_priority_lowest,
+	k_thread_priority_low,
+	k_thread_priority_high,
+	k_thread_priority_highest,
+	k_thread_priority_time_critical,
+} thread_priority_t;
+
+// Optional settings for thread_create_ex.
+// A zero-initialized struct gives the same thread as thread_create.
+typedef struct thread_options_t
+{
+	// Name shown in debuggers, profilers and trace captures. May be NULL.
+	const char* name;
+	// Bit mask of logical processors the thread may run on. Zero means any.
+	uint64_t affinity_mask;
+	thread_priority_t priority;
+} thread_options_t;
+
 // Creates a new thread.
 // Thread begins running function with data on return.
 thread_t* thread_create(int (*function)(void*), void* data);
 
+// Creates a new thread with a name, processor affinity and priority.
+// Settings are applied before the thread starts running function with data.
+thread_t* thread_create_ex(int (*function)(void*), void* data, const thread_options_t* options);
+
 // Waits for a thread to complete and destroys it.
 // Returns the thread's exit code.
-int thread_destroy(thread);
+int thread_destroy(thread_t* thread);
+
+// Names the calling thread, as thread_options_t.name does for new threads.
+void thread_set_name(const char* name);
+
+// Copies the calling thread's name into buffer.
+// Returns false, leaving buffer empty, if the thread has no name.
+bool thread_get_name(char* buffer, size_t size);
 
 // Puts the calling thread to sleep for the specified number of milliseconds.
 // Thread will sleep for *approximately* the specified time.
@@ -1026,6 +1026,95 @@ pool_t tlsf_add_pool(tlsf_t tlsf, void* mem, size_t bytes)
 	return mem;
 }
 
+int tlsf_extend_pool(tlsf_t tlsf, pool_t pool, size_t old_bytes, size_t new_bytes)
+{
+	control_t* control = tlsf_cast(control_t*, tlsf);
+	block_header_t* block;
+	block_header_t* next;
+
+	const size_t pool_overhead = tlsf_pool_overhead();
+	const size_t old_pool_bytes = align_down(old_bytes - pool_overhead, ALIGN_SIZE);
+	const size_t new_pool_bytes = align_down(new_bytes - pool_overhead, ALIGN_SIZE);
+
+	if (new_bytes <= old_bytes
+		|| new_pool_bytes - old_pool_bytes < block_size_min + block_header_overhead
+		|| new_pool_bytes > block_size_max)
+	{
+		return 0;
+	}
+
+	/*
+	** The old sentinel sits at the end of the pool. Turn it into a free
+	** block covering the new memory, merge it with a free predecessor,
+	** and place a fresh sentinel at the new end.
+	*/
+	block = offset_to_block(pool, old_pool_bytes);
+	tlsf_assert(block_size(block) == 0 && "pool end is not a sentinel");
+	block_set_size(block, new_pool_bytes - old_pool_bytes - block_header_overhead);
+	block_set_free(block);
+	block = block_merge_prev(control, block);
+
+	next = block_link_next(block);
+	block_set_size(next, 0);
+	block_set_used(next);
+	block_set_prev_free(next);
+
+	block_insert(control, block);
+
+	return 1;
+}
+
+size_t tlsf_pool_free_tail(pool_t pool, size_t bytes)
+{
+	const size_t pool_bytes = align_down(bytes - tlsf_pool_overhead(), ALIGN_SIZE);
+	block_header_t* sentinel = offset_to_block(pool, pool_bytes);
+	block_header_t* block;
+
+	tlsf_assert(block_size(sentinel) == 0 && "pool end is not a sentinel");
+	if (!block_is_prev_free(sentinel))
+	{
+		return 0;
+	}
+
+	/* The last block must stay behind, at least at the minimum size. */
+	block = block_prev(sentinel);
+	return block_size(block) - block_size_min;
+}
+
+int tlsf_shrink_pool(tlsf_t tlsf, pool_t pool, size_t old_bytes, size_t new_bytes)
+{
+	control_t* control = tlsf_cast(control_t*, tlsf);
+	block_header_t* block;
+	block_header_t* next;
+
+	const size_t pool_overhead = tlsf_pool_overhead();
+	const size_t old_pool_bytes = align_down(old_bytes - pool_overhead, ALIGN_SIZE);
+	const size_t new_pool_bytes = align_down(new_bytes - pool_overhead, ALIGN_SIZE);
+
+	if (new_bytes >= old_bytes
+		|| old_pool_bytes - new_pool_bytes > tlsf_pool_free_tail(pool, old_bytes))
+	{
+		return 0;
+	}
+
+	/*
+	** The free block in front of the sentinel loses the cut bytes,
+	** and a fresh sentinel goes at the new end.
+	*/
+	block = block_prev(offset_to_block(pool, old_pool_bytes));
+	block_remove(control, block);
+	block_set_size(block, block_size(block) - (old_pool_bytes - new_pool_bytes));
+
+	next = block_link_next(block);
+	block_set_size(next, 0);
+	block_set_used(next);
+	block_set_prev_free(next);
+
+	block_insert(control, block);
+
+	return 1;
+}
+
 void tlsf_remove_pool(tlsf_t tlsf, pool_t pool)
 {
 	control_t* control = tlsf_cast(control_t*, tlsf);
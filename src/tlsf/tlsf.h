@@ -58,6 +58,12 @@ pool_t tlsf_get_pool(tlsf_t tlsf);
 /* Add/remove memory pools. */
 pool_t tlsf_add_pool(tlsf_t tlsf, void* mem, size_t bytes);
 void tlsf_remove_pool(tlsf_t tlsf, pool_t pool);
+/* Grow a pool in place; the memory past old_bytes must follow it directly. */
+int tlsf_extend_pool(tlsf_t tlsf, pool_t pool, size_t old_bytes, size_t new_bytes);
+/* Bytes that could be cut from the end of a pool because they are free. */
+size_t tlsf_pool_free_tail(pool_t pool, size_t bytes);
+/* Shrink a pool in place; the memory past new_bytes must be free. */
+int tlsf_shrink_pool(tlsf_t tlsf, pool_t pool, size_t old_bytes, size_t new_bytes);
 
 /* malloc/memalign/realloc/free replacements. */
 void* tlsf_malloc(tlsf_t tlsf, size_t bytes);
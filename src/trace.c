@@ -1,14 +1,26 @@
 #include "trace.h"
 
+#include "debug.h"
 #include "heap.h"
+#include "lock_profile.h"
 #include "mutex.h"
 #include "fs.h"
+#include "thread.h"
 #include "timer.h"
 #include <windows.h>
+#include <stdarg.h>
 #include <stdio.h>
 
 #include <stddef.h>
 
+enum
+{
+	// Most lock names written per capture.
+	k_trace_lock_capacity = 64,
+	// Most bytes one event takes in the capture output, with its separator.
+	k_trace_output_event_size = 256 + 4,
+};
+
 
 // Struct for managing event struct and important class variables
 typedef struct trace_t
@@ -21,8 +33,17 @@ typedef struct trace_t
 	bool recording;
 	char* path;
 	struct event_t* next;
+	struct trace_thread_t* threads;
 } trace_t;
 
+// Name of a thread that has recorded events, written as trace metadata
+typedef struct trace_thread_t
+{
+	int tid;
+	char name[64];
+	struct trace_thread_t* next;
+} trace_thread_t;
+
 // Struct for each push and pop event
 typedef struct event_t
 {
@@ -39,15 +60,24 @@ typedef struct event_t
 trace_t* trace_create(heap_t* heap, int event_capacity)
 {
 	// Create Trace Struct
-	trace_t* trace = heap_alloc(heap, sizeof(trace_t), 8);
+	// Events and the capture output come from a child heap sized for event_capacity events
+	// plus two output events per recorded lock wait, so a long capture can't take memory
+	// from the rest of the engine. The output grows by doubling, and growing it may need
+	// the old and new buffers at once, so allow three times the lock wait output.
+	size_t budget = 1024 * 1024 + (size_t)event_capacity * 512 +
+		3 * (size_t)k_lock_profile_wait_capacity * 2 * k_trace_output_event_size;
+	heap_t* trace_heap = heap_create_child(heap, budget, k_heap_tag_trace, NULL, NULL);
+	trace_t* trace = heap_alloc_tagged(trace_heap, sizeof(trace_t), 8, k_heap_tag_trace);
 	trace->fs = fs_create(heap, event_capacity);
 	trace->mutex = mutex_create();
-	trace->heap = heap;
+	mutex_set_name(trace->mutex, "trace");
+	trace->heap = trace_heap;
 	trace->event_capacity = (size_t)event_capacity;
 	trace->occured_events = 0;
 	trace->recording = false;
 	trace->path = NULL;
 	trace->next = NULL;
+	trace->threads = NULL;
 	return trace;
 }
 
@@ -66,7 +96,14 @@ void trace_destroy(trace_t* trace)
 			cur_event = temp;
 		}
 	}
-	heap_free(trace->heap, trace);
+	while (trace->threads != NULL) {
+		trace_thread_t* temp = trace->threads->next;
+		heap_free(trace->heap, trace->threads);
+		trace->threads = temp;
+	}
+	heap_t* heap = trace->heap;
+	heap_free(heap, trace);
+	heap_destroy(heap);
 }
 
 void trace_duration_push(trace_t* trace, const char* name)
@@ -78,7 +115,10 @@ void trace_duration_push(trace_t* trace, const char* name)
 	}
 	
 	// Sets event variables
-	event_t* eve = heap_alloc(trace->heap, sizeof(event_t), 8);
+	event_t* eve = heap_alloc_tagged(trace->heap, sizeof(event_t), 8, k_heap_tag_trace);
+	if (eve == NULL) {
+		return;
+	}
 	// strcpy_s(eve->name, strlen(name), name);
 	eve->heap = trace->heap;
 	eve->name = _strdup(name);
@@ -90,6 +130,18 @@ void trace_duration_push(trace_t* trace, const char* name)
 	
 	mutex_lock(trace->mutex);
 
+	// Remembers the name of each thread the first time it records an event
+	trace_thread_t* thread = trace->threads;
+	while (thread != NULL && thread->tid != eve->tid) {
+		thread = thread->next;
+	}
+	if (thread == NULL && (thread = heap_alloc_tagged(trace->heap, sizeof(trace_thread_t), 8, k_heap_tag_trace)) != NULL) {
+		thread->tid = eve->tid;
+		thread_get_name(thread->name, sizeof(thread->name));
+		thread->next = trace->threads;
+		trace->threads = thread;
+	}
+
 	// Stores event
 	if (trace->next != NULL) {
 		event_t* cur_event = trace->next;
@@ -126,7 +178,11 @@ void trace_duration_pop(trace_t* trace)
 	}
 
 	// Create new event for popped
-	event_t* eve = heap_alloc(trace->heap, sizeof(event_t), 8);
+	event_t* eve = heap_alloc_tagged(trace->heap, sizeof(event_t), 8, k_heap_tag_trace);
+	if (eve == NULL) {
+		mutex_unlock(trace->mutex);
+		return;
+	}
 	// strcpy_s(eve->name, strlen(pop->name), pop->name);
 	eve->heap = trace->heap;
 	eve->name = _strdup(pop->name);
@@ -160,6 +216,64 @@ void trace_capture_start(trace_t* trace, const char* path)
 	// Starts capture and sets path
 	trace->recording = true;
 	trace->path = _strdup(path);
+	lock_profile_start();
+}
+
+// Output buffer for a capture, grown as events are appended
+typedef struct trace_output_t
+{
+	heap_t* heap;
+	char* data;
+	size_t length;
+	size_t capacity;
+	bool failed;
+} trace_output_t;
+
+// Make room for size more bytes of output.
+// On failure the output is marked failed and left as it was.
+static bool trace_output_reserve(trace_output_t* output, size_t size)
+{
+	if (output->failed) {
+		return false;
+	}
+	if (output->length + size + 1 <= output->capacity) {
+		return true;
+	}
+	size_t capacity = __max(output->capacity * 2, output->length + size + 1);
+	char* data = heap_realloc(output->heap, output->data, capacity, 8);
+	if (data == NULL) {
+		debug_print(k_print_warning, "Trace capture output exceeded %zuKB, dropping the rest of the capture.\n",
+			output->capacity / 1024);
+		output->failed = true;
+		return false;
+	}
+	output->data = data;
+	output->capacity = capacity;
+	return true;
+}
+
+// Append one formatted trace event, separated from the previous one by a comma
+static void trace_output_event(trace_output_t* output, const char* format, ...)
+{
+	if (output->failed) {
+		return;
+	}
+
+	char buffer[256];
+	va_list args;
+	va_start(args, format);
+	int buffer_length = vsnprintf(buffer, sizeof(buffer), format, args);
+	va_end(args);
+	buffer_length = __min(buffer_length, (int)sizeof(buffer) - 1);
+
+	const char* separator = output->data[output->length - 1] == '[' ? "\n\t\t" : ",\n\t\t";
+	size_t separator_length = strlen(separator);
+	if (!trace_output_reserve(output, separator_length + buffer_length)) {
+		return;
+	}
+	memcpy(output->data + output->length, separator, separator_length);
+	memcpy(output->data + output->length + separator_length, buffer, buffer_length + 1);
+	output->length += separator_length + buffer_length;
 }
 
 void trace_capture_stop(trace_t* trace)
@@ -169,32 +283,86 @@ void trace_capture_stop(trace_t* trace)
 		return;
 	}
 	trace->recording = false;
+	lock_profile_stop();
 
 	// Creates formatted json file with pushed and popped events
-	char output[4096] = "{\n\t\"displayTimeUnit\": \"ns\", \"traceEvents\": [";
-	char buffer[256];
-	event_t* eve = trace->next;
-	while (eve != NULL) {
-		if (eve->next == NULL) {
-			snprintf(buffer, sizeof(buffer),
-				"\n\t\t{\"name\":\"%s\",\"ph\":\"%s\",\"pid\":\"%d\",\"tid\":\"%d\",\"ts\":\"%zu\"}",
-				eve->name, eve->ph, eve->pid, eve->tid, (size_t)eve->time);
+	const char* start = "{\n\t\"displayTimeUnit\": \"ns\", \"traceEvents\": [";
+	trace_output_t output;
+	output.heap = trace->heap;
+	output.capacity = 4096;
+	output.length = strlen(start);
+	output.failed = false;
+	output.data = heap_alloc_tagged(trace->heap, output.capacity, 8, k_heap_tag_trace);
+	if (output.data == NULL) {
+		debug_print(k_print_warning, "Trace capture output could not be allocated, dropping the capture.\n");
+		return;
+	}
+	memcpy(output.data, start, output.length + 1);
+
+	int pid = (int)GetCurrentProcessId();
+
+	// Thread names come first as metadata events; unnamed threads keep their ids
+	for (trace_thread_t* thread = trace->threads; thread != NULL; thread = thread->next) {
+		if (thread->name[0] == '\0') {
+			continue;
 		}
-		else {
-			snprintf(buffer, sizeof(buffer),
-				"\n\t\t{\"name\":\"%s\",\"ph\":\"%s\",\"pid\":\"%d\",\"tid\":\"%d\",\"ts\":\"%zu\"},",
-				eve->name, eve->ph, eve->pid, eve->tid, (size_t)eve->time);
+		trace_output_event(&output,
+			"{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":\"%d\",\"tid\":\"%d\",\"args\":{\"name\":\"%s\"}}",
+			pid, thread->tid, thread->name);
+	}
+
+	for (event_t* eve = trace->next; eve != NULL; eve = eve->next) {
+		trace_output_event(&output,
+			"{\"name\":\"%s\",\"ph\":\"%s\",\"pid\":\"%d\",\"tid\":\"%d\",\"ts\":\"%zu\"}",
+			eve->name, eve->ph, eve->pid, eve->tid, (size_t)eve->time);
+	}
+
+	// Each wait on a named lock is a slice on the waiting thread,
+	// and updates that lock's counter track with its running totals
+	int wait_count = 0;
+	const lock_profile_wait_t* waits = lock_profile_get_waits(&wait_count);
+	for (int i = 0; i < wait_count; ++i) {
+		const lock_profile_wait_t* wait = &waits[i];
+		uint64_t wait_start = timer_ticks_to_us(wait->start_ticks);
+		uint64_t wait_end = timer_ticks_to_us(wait->start_ticks + wait->wait_ticks);
+		trace_output_event(&output,
+			"{\"name\":\"wait %s\",\"cat\":\"lock\",\"ph\":\"X\",\"pid\":\"%d\",\"tid\":\"%d\",\"ts\":\"%zu\",\"dur\":\"%zu\"}",
+			wait->name, pid, wait->tid, (size_t)wait_start, (size_t)(wait_end - wait_start));
+		trace_output_event(&output,
+			"{\"name\":\"lock %s\",\"ph\":\"C\",\"pid\":\"%d\",\"ts\":\"%zu\",\"args\":{\"contended\":%zu,\"wait_us\":%zu,\"hold_us\":%zu}}",
+			wait->name, pid, (size_t)wait_end, (size_t)wait->contended_count,
+			(size_t)timer_ticks_to_us(wait->total_wait_ticks), (size_t)timer_ticks_to_us(wait->total_hold_ticks));
+	}
+
+	// Totals for every lock that was used, at the end of the capture
+	lock_profile_stats_t stats[k_trace_lock_capacity];
+	int stats_count = lock_profile_get_stats(stats, k_trace_lock_capacity);
+	uint64_t now = timer_ticks_to_us(timer_get_ticks());
+	for (int i = 0; i < stats_count; ++i) {
+		if (stats[i].acquire_count == 0) {
+			continue;
 		}
+		trace_output_event(&output,
+			"{\"name\":\"lock %s\",\"ph\":\"C\",\"pid\":\"%d\",\"ts\":\"%zu\",\"args\":{\"contended\":%zu,\"wait_us\":%zu,\"hold_us\":%zu}}",
+			stats[i].name, pid, (size_t)now, (size_t)stats[i].contended_count,
+			(size_t)timer_ticks_to_us(stats[i].wait_ticks), (size_t)timer_ticks_to_us(stats[i].hold_ticks));
+	}
 
-		strcat_s(output, 4096 - strlen(output), buffer);
-		// printf(output); // testing
-		eve = eve->next;
+	// The events written so far still end the output, so a capture that ran out of
+	// memory is written short rather than as broken JSON.
+	const char* end = "\n\t]\n}";
+	output.failed = false;
+	if (!trace_output_reserve(&output, strlen(end))) {
+		heap_free(trace->heap, output.data);
+		return;
 	}
+	memcpy(output.data + output.length, end, strlen(end) + 1);
+	output.length += strlen(end);
 
-	char* end = "\n\t]\n}";
-	strcat_s(output, 4096 - strlen(output), end);
-	
 	// Creates and writes in file
-	fs_work_t* work = fs_write(trace->fs, trace->path, output, strlen(output), false);
-	fs_work_is_done(work);
+	// The write reads from output, so wait for it before freeing.
+	fs_work_t* work = fs_write(trace->fs, trace->path, output.data, output.length, false);
+	fs_work_wait(work);
+	fs_work_destroy(work);
+	heap_free(trace->heap, output.data);
 }